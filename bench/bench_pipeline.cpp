@@ -0,0 +1,327 @@
+// Host-side benchmark and replay harness for the measurement pipeline.
+//
+//   pio run -e native && .pio/build/native/program [trace.csv] [options]
+//
+// Replays an accelerometer trace through the same
+// MeasurementAccumulator the firmware uses, cut into measurement windows.
+// Without a trace a synthetic one is generated at the firmware's default rate.
+// A trace is either a capture file from GET /api/capture/data (TraceHeader and
+// TraceSample records, see claybath_core.h) or CSV: timestamp_us,x,y,z, one
+// sample per line, '#' comments and a header line are skipped.
+//
+// Reports ns/sample for each pipeline stage, heap allocations per measurement
+// and the estimator's convergence time in trace time.
+//
+// Options:
+//   --duration S     measurement window in seconds (default 10)
+//   --threshold D    convergence threshold, degrees standard error (default 0.02)
+//   --rate HZ        synthetic trace rate (default 200)
+//   --seconds S      synthetic trace length (default 600)
+//   --angle D        synthetic probe angle (default 42)
+//   --noise C        synthetic noise, raw counts sigma (default 40)
+
+#include <claybath_core.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include <random>
+#include <vector>
+
+// Every heap allocation goes through here so the replay can count them
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+  allocations++;
+  void *p = malloc(size ? size : 1);
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+struct Options
+{
+  const char *tracePath = NULL;
+  float duration = 10;
+  float threshold = 0.02f;
+  int rate = 200;
+  float seconds = 600;
+  float angle = 42;
+  float noise = 40;
+};
+
+static double nowNs()
+{
+  using namespace std::chrono;
+  return (double)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Binary capture from the device; the file position is just past the magic
+static bool loadCapture(FILE *file, std::vector<AccelSample> &trace)
+{
+  TraceHeader header;
+  header.magic = TRACE_MAGIC;
+  if (fread((uint8_t *)&header + sizeof(header.magic), sizeof(header) - sizeof(header.magic), 1, file) != 1 ||
+      header.version > TRACE_VERSION || header.headerSize < sizeof(header) ||
+      fseek(file, header.headerSize, SEEK_SET) != 0)
+  {
+    fprintf(stderr, "bad capture header\n");
+    return false;
+  }
+
+  printf("capture: %u Hz, +-%u g, %u samples (%u dropped), measuring from sample %d\n",
+         (unsigned)header.sampleRateHz, (unsigned)header.accelRangeG, (unsigned)header.sampleCount,
+         (unsigned)header.droppedSamples, header.measureStart == 0xFFFFFFFF ? -1 : (int)header.measureStart);
+
+  // sampleCount is 0 in a download taken while the capture was running
+  TraceSample sample;
+  while ((header.sampleCount == 0 || trace.size() < header.sampleCount) &&
+         fread(&sample, sizeof(sample), 1, file) == 1)
+  {
+    AccelSample converted = {sample.timestampUs, sample.x, sample.y, sample.z};
+    trace.push_back(converted);
+  }
+  return true;
+}
+
+static bool loadTrace(const char *path, std::vector<AccelSample> &trace)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    fprintf(stderr, "cannot open %s\n", path);
+    return false;
+  }
+
+  uint32_t magic = 0;
+  if (fread(&magic, sizeof(magic), 1, file) == 1 && magic == TRACE_MAGIC)
+  {
+    bool ok = loadCapture(file, trace);
+    fclose(file);
+    return ok;
+  }
+  rewind(file);
+
+  char line[128];
+  while (fgets(line, sizeof(line), file))
+  {
+    unsigned long timestamp;
+    int x, y, z;
+    if (line[0] == '#' || sscanf(line, "%lu,%d,%d,%d", &timestamp, &x, &y, &z) != 4)
+      continue; // Comment or header
+    AccelSample sample = {(uint32_t)timestamp, (int16_t)x, (int16_t)y, (int16_t)z};
+    trace.push_back(sample);
+  }
+  fclose(file);
+  return !trace.empty();
+}
+
+// Gravity at a fixed tilt with gaussian noise and occasional vibration spikes
+static void synthesizeTrace(const Options &options, std::vector<AccelSample> &trace)
+{
+  const float countsPerG = 4096; // MPU6050 at +-8 g, as configured by the firmware
+  std::mt19937 rng(1);
+  std::normal_distribution<float> noise(0, options.noise);
+  std::uniform_real_distribution<float> uniform(0, 1);
+
+  float radians = options.angle / 57.2957795f;
+  size_t count = (size_t)(options.seconds * options.rate);
+  uint32_t periodUs = 1000000 / options.rate;
+  trace.reserve(count);
+  for (size_t i = 0; i < count; i++)
+  {
+    float spike = uniform(rng) < 0.005f ? 4000 : 0;
+    AccelSample sample;
+    sample.timestampUs = (uint32_t)(i * periodUs);
+    sample.x = (int16_t)noise(rng);
+    sample.y = (int16_t)(countsPerG * sinf(radians) + noise(rng) + spike);
+    sample.z = (int16_t)(countsPerG * cosf(radians) + noise(rng));
+    trace.push_back(sample);
+  }
+}
+
+static bool parseOptions(int argc, char **argv, Options &options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (arg[0] != '-')
+    {
+      options.tracePath = arg;
+      continue;
+    }
+    if (!value)
+      return false;
+    if (!strcmp(arg, "--duration"))
+      options.duration = atof(value);
+    else if (!strcmp(arg, "--threshold"))
+      options.threshold = atof(value);
+    else if (!strcmp(arg, "--rate"))
+      options.rate = atoi(value);
+    else if (!strcmp(arg, "--seconds"))
+      options.seconds = atof(value);
+    else if (!strcmp(arg, "--angle"))
+      options.angle = atof(value);
+    else if (!strcmp(arg, "--noise"))
+      options.noise = atof(value);
+    else
+      return false;
+    i++;
+  }
+  return options.duration > 0 && options.rate > 0;
+}
+
+// Time 'body' over the whole trace, best of a few passes to shed scheduler noise
+template <typename Body>
+static double nsPerSample(const std::vector<AccelSample> &trace, Body body)
+{
+  double best = 1e30;
+  for (int pass = 0; pass < 5; pass++)
+  {
+    double start = nowNs();
+    body();
+    best = std::min(best, (nowNs() - start) / trace.size());
+  }
+  return best;
+}
+
+int main(int argc, char **argv)
+{
+  Options options;
+  if (!parseOptions(argc, argv, options))
+  {
+    fprintf(stderr, "usage: %s [trace.csv] [--duration S] [--threshold D] [--rate HZ] "
+                    "[--seconds S] [--angle D] [--noise C]\n", argv[0]);
+    return 2;
+  }
+
+  std::vector<AccelSample> trace;
+  if (options.tracePath)
+    loadTrace(options.tracePath, trace);
+  else
+    synthesizeTrace(options, trace);
+  if (trace.empty())
+  {
+    fprintf(stderr, "no samples in trace\n");
+    return 1;
+  }
+  printf("trace: %s, %zu samples, %.1f s\n", options.tracePath ? options.tracePath : "synthetic",
+         trace.size(), (trace.back().timestampUs - trace.front().timestampUs) / 1e6);
+
+  static uint16_t lut[CAL_LUT_SIZE];
+  buildDensityLut(lut, 0, NULL, NULL, 0.0f, 1.0f);
+
+  // Throughput of each stage
+  volatile float sink = 0;
+  double angleNs = nsPerSample(trace, [&]() {
+    float sum = 0;
+    for (const AccelSample &sample : trace)
+      sum += sampleAngle(sample);
+    sink = sum;
+  });
+  double accumulateNs = nsPerSample(trace, [&]() {
+    MeasurementAccumulator accumulator;
+    accumulator.reset();
+    for (const AccelSample &sample : trace)
+      accumulator.add(sample);
+    sink = accumulator.meanAngle();
+  });
+  double densityNs = nsPerSample(trace, [&]() {
+    float sum = 0;
+    for (size_t i = 0; i < trace.size(); i++)
+      sum += lutDensity(lut, -90.0f + (i % 18000) * 0.01f);
+    sink = sum;
+  });
+  double formatNs = nsPerSample(trace, [&]() {
+    char row[96];
+    int total = 0;
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+      LogRecord record = encodeLogRecord(1700000000 + i, 1.025f, 42.5f, 0.12f, 2000, 1, 0);
+      total += formatLogRecordCsv(record, row, sizeof(row));
+    }
+    sink = total;
+  });
+
+  printf("\nns/sample\n");
+  printf("  sampleAngle (CORDIC)      %8.1f\n", angleNs);
+  printf("  accumulator add           %8.1f\n", accumulateNs);
+  printf("  lutDensity                %8.1f\n", densityNs);
+  printf("  encode + CSV row          %8.1f\n", formatNs);
+
+  // Replay in measurement windows, timed by the trace's own timestamps
+  uint32_t windowUs = (uint32_t)(options.duration * 1e6f);
+  size_t measurements = 0, convergedCount = 0;
+  size_t measurementAllocations = 0;
+  double convergeSum = 0, convergeMax = 0;
+  double angleSum = 0, angleSq = 0;
+  uint32_t rejected = 0, seen = 0;
+
+  size_t i = 0;
+  while (i < trace.size())
+  {
+    uint32_t start = trace[i].timestampUs;
+    if (trace.back().timestampUs - start < windowUs)
+      break; // Partial window at the end
+
+    size_t before = allocations;
+    MeasurementAccumulator accumulator;
+    accumulator.reset();
+    double convergedAt = -1;
+    for (; i < trace.size() && trace[i].timestampUs - start < windowUs; i++)
+    {
+      accumulator.add(trace[i]);
+      if (convergedAt < 0 && accumulator.converged(options.threshold))
+        convergedAt = (trace[i].timestampUs - start) / 1e6;
+    }
+    float angle = accumulator.meanAngle();
+    measurementAllocations += allocations - before;
+
+    measurements++;
+    angleSum += angle;
+    angleSq += (double)angle * angle;
+    rejected += accumulator.estimator.rejected;
+    seen += accumulator.total;
+    if (convergedAt >= 0)
+    {
+      convergedCount++;
+      convergeSum += convergedAt;
+      convergeMax = std::max(convergeMax, convergedAt);
+    }
+  }
+
+  if (measurements == 0)
+  {
+    printf("\ntrace shorter than one %.1f s window\n", options.duration);
+    return 1;
+  }
+
+  double meanAngle = angleSum / measurements;
+  double spread = measurements > 1 ? sqrt(std::max(0.0, (angleSq - angleSum * meanAngle) / (measurements - 1))) : 0;
+  printf("\nreplay: %zu windows of %.1f s\n", measurements, options.duration);
+  printf("  allocations/measurement   %8.2f\n", (double)measurementAllocations / measurements);
+  printf("  mean angle / spread       %8.3f / %.4f deg\n", meanAngle, spread);
+  printf("  density (default curve)   %8.4f\n", lutDensity(lut, (float)meanAngle));
+  printf("  rejected samples          %8.2f %%\n", seen ? 100.0 * rejected / seen : 0.0);
+  if (convergedCount > 0)
+    printf("  converged                 %zu/%zu, mean %.2f s, max %.2f s\n",
+           convergedCount, measurements, convergeSum / convergedCount, convergeMax);
+  else
+    printf("  converged                 0/%zu (threshold %.3f deg)\n", measurements, options.threshold);
+  if (!options.tracePath)
+    printf("  error vs. true angle      %8.4f deg\n", meanAngle - options.angle);
+  return 0;
+}
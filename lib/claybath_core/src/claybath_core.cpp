@@ -0,0 +1,178 @@
+#include "claybath_core.h"
+
+#include <stdio.h>
+
+// Tilt angle in degrees from a raw sample; scale cancels out in atan2
+float sampleAngle(const AccelSample &sample)
+{
+  return cordicAtan2(sample.y, sample.z) / 65536.0f;
+}
+
+// atan(2^-i) in degrees, Q16
+static const int32_t cordicAtanTable[CORDIC_ITERATIONS] = {
+    2949120, 1740967, 919879, 466945, 234379, 117304, 58666, 29335,
+    14668, 7334, 3667, 1833, 917, 458, 229, 115};
+
+// Integer CORDIC (vectoring mode) atan2 on raw counts. Returns degrees in Q16
+// (65536 = 1 degree), using only shifts and adds.
+int32_t cordicAtan2(int32_t y, int32_t x)
+{
+  int32_t angle = 0;
+
+  // Extra fraction bits; int16 inputs times the CORDIC gain still fit easily
+  x *= 256;
+  y *= 256;
+
+  // Rotate the left half-plane by 90 degrees into the convergence range
+  if (x < 0)
+  {
+    int32_t t = x;
+    if (y >= 0)
+    {
+      x = y;
+      y = -t;
+      angle = 90 * 65536;
+    }
+    else
+    {
+      x = -y;
+      y = t;
+      angle = -90 * 65536;
+    }
+  }
+
+  for (int i = 0; i < CORDIC_ITERATIONS; i++)
+  {
+    int32_t dx = y >> i;
+    int32_t dy = x >> i;
+    if (y > 0)
+    {
+      x += dx;
+      y -= dy;
+      angle += cordicAtanTable[i];
+    }
+    else
+    {
+      x -= dx;
+      y += dy;
+      angle -= cordicAtanTable[i];
+    }
+  }
+  return angle;
+}
+
+// Linear formula with offset/scale, or piecewise linear through the points
+float calibrationDensity(float angle, int count, const float *angles, const float *densities,
+                         float offset, float scale)
+{
+  float density;
+
+  if (count < 2)
+  {
+    float calibratedAngle = (angle + offset) * scale;
+    density = 1.000 + (calibratedAngle / 45.0) * 0.050; // 45° = 0.05 density units
+  }
+  else
+  {
+    int segment = 0;
+    while (segment < count - 2 && angle > angles[segment + 1])
+    {
+      segment++;
+    }
+    float t = (angle - angles[segment]) / (angles[segment + 1] - angles[segment]);
+    density = densities[segment] + t * (densities[segment + 1] - densities[segment]);
+  }
+
+  // Ensure reasonable bounds
+  return std::min(std::max(density, DENSITY_MIN), DENSITY_MAX);
+}
+
+void buildDensityLut(uint16_t *lut, int count, const float *angles, const float *densities,
+                     float offset, float scale)
+{
+  for (int i = 0; i < CAL_LUT_SIZE; i++)
+  {
+    float angle = CAL_LUT_MIN_ANGLE + (float)i / CAL_LUT_STEPS_PER_DEGREE;
+    lut[i] = (uint16_t)lroundf(calibrationDensity(angle, count, angles, densities, offset, scale) * CAL_LUT_SCALE);
+  }
+}
+
+float lutDensity(const uint16_t *lut, float angle)
+{
+  float position = (angle - CAL_LUT_MIN_ANGLE) * CAL_LUT_STEPS_PER_DEGREE;
+  if (!(position > 0))
+  {
+    return lut[0] / CAL_LUT_SCALE; // Also catches NaN
+  }
+  if (position >= CAL_LUT_SIZE - 1)
+  {
+    return lut[CAL_LUT_SIZE - 1] / CAL_LUT_SCALE;
+  }
+
+  int index = (int)position;
+  int32_t fraction = (int32_t)((position - index) * 256); // Q8
+  int32_t low = lut[index];
+  int32_t high = lut[index + 1];
+  return (low + (((high - low) * fraction) >> 8)) / CAL_LUT_SCALE;
+}
+
+void rollupAdd(RollupBucket *ring, int size, uint32_t period, uint32_t timestamp, float value)
+{
+  uint32_t start = timestamp - timestamp % period;
+  RollupBucket &bucket = ring[(start / period) % size];
+  if (bucket.start != start)
+  {
+    if (bucket.start > start)
+    {
+      return;
+    }
+    bucket.reset(start);
+  }
+  bucket.add(value);
+}
+
+LogRecord encodeLogRecord(uint32_t timestamp, float density, float angle, float stddev,
+                          uint32_t samples, uint16_t flags, uint16_t replicates)
+{
+  LogRecord record;
+  record.timestamp = timestamp;
+  record.density = density;
+  record.angle = angle;
+  record.stddev = stddev;
+  record.samples = samples;
+  record.flags = flags;
+  record.replicates = replicates;
+  return record;
+}
+
+// Unix time to UTC calendar fields (days-from-civil inverted, valid past 2100)
+static void civilFromUnix(uint32_t unixTime, int &year, int &month, int &day,
+                          int &hour, int &minute, int &second)
+{
+  uint32_t days = unixTime / 86400;
+  uint32_t seconds = unixTime % 86400;
+  hour = seconds / 3600;
+  minute = seconds / 60 % 60;
+  second = seconds % 60;
+
+  uint32_t z = days + 719468; // Days since 0000-03-01
+  uint32_t era = z / 146097;
+  uint32_t doe = z - era * 146097;
+  uint32_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  uint32_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  uint32_t mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year = yoe + era * 400 + (month <= 2 ? 1 : 0);
+}
+
+int formatLogRecordCsv(const LogRecord &record, char *buffer, size_t length)
+{
+  int year, month, day, hour, minute, second;
+  civilFromUnix(record.timestamp, year, month, day, hour, minute, second);
+  return snprintf(buffer, length, "%04d-%02d-%02d %02d:%02d:%02d,%.4f,%.2f,%.3f,%u,%u,%u,%u\n",
+                  year, month, day, hour, minute, second,
+                  record.density, record.angle, record.stddev,
+                  (unsigned)record.samples, (unsigned)(record.flags & LOG_FLAGS_MASK),
+                  (unsigned)record.replicates, (unsigned)(record.flags >> LOG_CHANNEL_SHIFT));
+}
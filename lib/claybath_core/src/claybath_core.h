@@ -0,0 +1,296 @@
+// Hardware-independent measurement pipeline: sample angle, streaming
+// statistics, calibration lookup and the log record encoding. No Arduino,
+// FreeRTOS or driver includes, so the same code builds for the ESP32 and for
+// the native benchmark (see bench/).
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+// Streaming angle estimator configuration
+#define HAMPEL_WINDOW 11          // Trailing window for the median/MAD outlier test
+#define HAMPEL_SIGMAS 3.0f        // Reject samples further than this many robust sigmas
+#define HAMPEL_MIN_MAD 0.01f      // Degrees; keeps quantized, noise-free windows from rejecting everything
+#define MIN_CONVERGENCE_SAMPLES 100
+#define CORDIC_ITERATIONS 16       // ~0.003 degree worst case on int16 inputs
+
+// Calibration curve
+#define CAL_MAX_POINTS 8              // Reference (angle, density) pairs
+#define CAL_LUT_MIN_ANGLE -90.0f      // Lookup table covers the full tilt range
+#define CAL_LUT_STEPS_PER_DEGREE 4    // 0.25 degree spacing, interpolated in between
+#define CAL_LUT_SIZE (180 * CAL_LUT_STEPS_PER_DEGREE + 1)
+#define CAL_LUT_SCALE 10000.0f        // Densities stored in 1/10000 units
+#define DENSITY_MIN 0.900f
+#define DENSITY_MAX 1.200f
+
+// Raw accelerometer sample produced by the sensor task
+struct AccelSample
+{
+  uint32_t timestampUs;
+  int16_t x;
+  int16_t y;
+  int16_t z;
+};
+
+// LogRecord.flags: measurement flags in the low 12 bits, the probe channel
+// that took the reading in the top 4
+#define LOG_CHANNEL_SHIFT 12
+#define LOG_FLAGS_MASK 0x0FFF
+
+// Fixed-size binary measurement record, appended to the log segment files
+struct __attribute__((packed)) LogRecord
+{
+  uint32_t timestamp; // Unix time
+  float density;
+  float angle;
+  float stddev;
+  uint32_t samples;
+  uint16_t flags;     // See LOG_CHANNEL_SHIFT
+  uint16_t replicates; // Readings aggregated into a series record, 0 = single reading
+};
+static_assert(sizeof(LogRecord) == 24, "LogRecord must stay 24 bytes");
+
+// Raw trace capture file: TraceHeader, then 'sampleCount' TraceSample records
+// appended in order, at most 'capacity'. A file read while the capture is
+// still running has sampleCount 0; read samples up to EOF then.
+#define TRACE_MAGIC 0x43525443 // "CTRC"
+#define TRACE_VERSION 1
+
+struct __attribute__((packed)) TraceSample
+{
+  uint32_t timestampUs;
+  int16_t x;
+  int16_t y;
+  int16_t z;
+};
+static_assert(sizeof(TraceSample) == 10, "TraceSample must stay 10 bytes");
+
+struct __attribute__((packed)) TraceHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize; // Offset of the first sample
+  uint32_t startTime;  // Unix time
+  uint16_t sampleRateHz;
+  uint8_t accelRangeG;
+  uint8_t acquisitionMode;
+  uint32_t capacity;
+  uint32_t sampleCount;
+  uint32_t droppedSamples; // Lost because flash fell behind
+  uint32_t measureStart;   // Sample index where settling ended and MEASURING began
+  uint32_t measureEnd;
+  // Settings snapshot
+  uint32_t fillDurationMs;
+  uint16_t waitDuration;
+  uint16_t measurementDuration;
+  uint16_t settleStableSeconds;
+  uint16_t channel;     // Probe channel, 0 in single-probe builds
+  float settleThreshold;
+  float convergenceThreshold;
+  float calibrationOffset;
+  float calibrationScale;
+};
+
+// Upload batch POSTed to a collector: UploadHeader, then 'count' LogRecords in
+// log order. Any 2xx response acknowledges the whole batch.
+#define UPLOAD_MAGIC 0x4C505543 // "CUPL"
+#define UPLOAD_VERSION 1
+
+struct __attribute__((packed)) UploadHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize; // Offset of the first record
+  uint8_t deviceId[6]; // Factory MAC of the device
+  uint16_t recordSize; // sizeof(LogRecord)
+  uint32_t count;
+  uint32_t sentAt;     // Unix time, 0 if the clock was never set
+  // Device metrics when the batch was sent
+  uint32_t uptimeS;
+  uint32_t freeHeap;
+  uint32_t minFreeHeap;
+  uint32_t sampleOverruns;
+  int8_t rssi;         // Station link, dBm
+  uint8_t probeChannels;
+  uint16_t reserved;
+};
+static_assert(sizeof(UploadHeader) == 44, "UploadHeader layout is part of the upload format");
+
+// Streaming angle statistics: a Hampel filter (trailing median/MAD) rejects
+// outliers, accepted samples feed Welford's running mean and variance.
+struct AngleEstimator
+{
+  float window[HAMPEL_WINDOW];
+  int windowCount;
+  int windowIndex;
+  uint32_t count;
+  uint32_t rejected;
+  double mean;
+  double m2;
+
+  void reset()
+  {
+    windowCount = 0;
+    windowIndex = 0;
+    count = 0;
+    rejected = 0;
+    mean = 0.0;
+    m2 = 0.0;
+  }
+
+  // Returns true if the sample was accepted
+  bool add(float angle)
+  {
+    bool accept = true;
+    if (windowCount == HAMPEL_WINDOW)
+    {
+      float scratch[HAMPEL_WINDOW];
+      memcpy(scratch, window, sizeof(scratch));
+      std::nth_element(scratch, scratch + HAMPEL_WINDOW / 2, scratch + HAMPEL_WINDOW);
+      float median = scratch[HAMPEL_WINDOW / 2];
+
+      for (int i = 0; i < HAMPEL_WINDOW; i++)
+      {
+        scratch[i] = fabsf(window[i] - median);
+      }
+      std::nth_element(scratch, scratch + HAMPEL_WINDOW / 2, scratch + HAMPEL_WINDOW);
+      float mad = std::max(scratch[HAMPEL_WINDOW / 2], HAMPEL_MIN_MAD);
+
+      // 1.4826 * MAD estimates sigma for normally distributed noise
+      accept = fabsf(angle - median) <= HAMPEL_SIGMAS * 1.4826f * mad;
+    }
+
+    window[windowIndex] = angle;
+    windowIndex = (windowIndex + 1) % HAMPEL_WINDOW;
+    if (windowCount < HAMPEL_WINDOW)
+      windowCount++;
+
+    if (!accept)
+    {
+      rejected++;
+      return false;
+    }
+
+    count++;
+    double delta = angle - mean;
+    mean += delta / count;
+    m2 += delta * (angle - mean);
+    return true;
+  }
+
+  float stddev() const
+  {
+    return count > 1 ? sqrt(m2 / (count - 1)) : 0.0f;
+  }
+
+  float standardError() const
+  {
+    return count > 1 ? stddev() / sqrt((double)count) : INFINITY;
+  }
+};
+
+int32_t cordicAtan2(int32_t y, int32_t x);
+float sampleAngle(const AccelSample &sample);
+
+// One reading: every sample feeds the robust statistics, accepted samples
+// also feed the raw y/z sums whose averaged gravity vector gives the result
+struct MeasurementAccumulator
+{
+  AngleEstimator estimator;
+  int64_t sumY;
+  int64_t sumZ;
+  uint32_t total; // Samples seen, accepted or not
+
+  void reset()
+  {
+    estimator.reset();
+    sumY = 0;
+    sumZ = 0;
+    total = 0;
+  }
+
+  // Returns the angle of this sample
+  float add(const AccelSample &sample)
+  {
+    float angle = sampleAngle(sample);
+    if (fabsf(angle) < 90 && estimator.add(angle))
+    { // Reasonable angle range, not an outlier
+      sumY += sample.y;
+      sumZ += sample.z;
+    }
+    total++;
+    return angle;
+  }
+
+  // Mean known precisely enough to stop early; threshold 0 disables
+  bool converged(float threshold) const
+  {
+    return threshold > 0 && estimator.count >= MIN_CONVERGENCE_SAMPLES &&
+           estimator.standardError() < threshold;
+  }
+
+  // One atan2 of the averaged vector, raw degrees (no calibration offset)
+  float meanAngle() const
+  {
+    return atan2f((float)sumY, (float)sumZ) * 57.2957795f;
+  }
+};
+
+// Running density statistics of one hour, day or batch
+struct RollupBucket
+{
+  uint32_t start; // Unix time the period starts, 0 = unused
+  uint32_t count;
+  float min;
+  float max;
+  double sum;
+
+  void reset(uint32_t periodStart)
+  {
+    start = periodStart;
+    count = 0;
+    min = INFINITY;
+    max = -INFINITY;
+    sum = 0.0;
+  }
+
+  void add(float value)
+  {
+    count++;
+    min = std::min(min, value);
+    max = std::max(max, value);
+    sum += value;
+  }
+
+  float mean() const
+  {
+    return count ? sum / count : 0.0f;
+  }
+};
+
+// Fold a value into a ring of 'size' consecutive periods of 'period' seconds,
+// slot (start / period) % size. A value for a period older than the one now
+// occupying its slot has aged out and is ignored.
+void rollupAdd(RollupBucket *ring, int size, uint32_t period, uint32_t timestamp, float value);
+
+// Exact calibration curve. With fewer than two reference points the linear
+// formula applies (offset and scale included); otherwise the points, sorted by
+// angle, are joined piecewise linearly and the end segments are extended.
+float calibrationDensity(float angle, int count, const float *angles, const float *densities,
+                         float offset, float scale);
+
+// Fill a CAL_LUT_SIZE table from the curve above
+void buildDensityLut(uint16_t *lut, int count, const float *angles, const float *densities,
+                     float offset, float scale);
+
+// Density for a raw probe angle, constant time from the fixed-point table
+float lutDensity(const uint16_t *lut, float angle);
+
+LogRecord encodeLogRecord(uint32_t timestamp, float density, float angle, float stddev,
+                          uint32_t samples, uint16_t flags, uint16_t replicates);
+
+// One CSV export row: Timestamp,Density,Angle,StdDev,Samples,Flags,Replicates,Channel
+int formatLogRecordCsv(const LogRecord &record, char *buffer, size_t length);
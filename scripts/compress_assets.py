@@ -0,0 +1,67 @@
+# PlatformIO pre-script: stage gzip-compressed copies of data/ for the
+# LittleFS image, so the web server sends index.html.gz with
+# Content-Encoding: gzip instead of the full page.
+#
+# Runs for the buildfs/uploadfs targets only. data/ stays the editable
+# source; the image is built from $BUILD_DIR/data instead. Text assets are
+# gzipped (optionally minified first, custom_minify_assets = yes), everything
+# else is copied unchanged. The firmware derives each asset's ETag from the
+# staged file's CRC at boot.
+
+import gzip
+import os
+import re
+import shutil
+
+Import("env")
+
+COMPRESSED_TYPES = (".html", ".htm", ".js", ".css", ".json", ".svg", ".txt")
+
+
+def minify(text, name):
+    # Conservative: drop indentation, blank lines and HTML comments. Inline
+    # scripts keep their line breaks, so no statement depends on semicolons.
+    if name.endswith((".html", ".htm")):
+        text = re.sub(r"<!--(?!\[if).*?-->", "", text, flags=re.S)
+    lines = (line.strip() for line in text.splitlines())
+    return "\n".join(line for line in lines if line)
+
+
+def stage_assets(source, target, minify_text):
+    if os.path.isdir(target):
+        shutil.rmtree(target)
+    os.makedirs(target)
+
+    for root, _, files in os.walk(source):
+        out_dir = os.path.join(target, os.path.relpath(root, source))
+        if not os.path.isdir(out_dir):
+            os.makedirs(out_dir)
+
+        for name in files:
+            path = os.path.join(root, name)
+            if not name.lower().endswith(COMPRESSED_TYPES):
+                shutil.copy2(path, os.path.join(out_dir, name))
+                continue
+
+            with open(path, "rb") as f:
+                data = f.read()
+            if minify_text:
+                data = minify(data.decode("utf-8"), name.lower()).encode("utf-8")
+
+            # mtime 0 keeps the output, and so the ETag, identical across builds
+            packed = os.path.join(out_dir, name + ".gz")
+            with open(packed, "wb") as raw:
+                with gzip.GzipFile(filename="", mode="wb", fileobj=raw, compresslevel=9, mtime=0) as gz:
+                    gz.write(data)
+
+            print("Assets: %s %d -> %d bytes" % (
+                os.path.relpath(path, source), os.path.getsize(path), os.path.getsize(packed)))
+
+
+if any(t in COMMAND_LINE_TARGETS for t in ("buildfs", "uploadfs", "uploadfsota")):
+    source = env.subst("$PROJECT_DATA_DIR")
+    target = os.path.join(env.subst("$BUILD_DIR"), "data")
+    minify_text = env.GetProjectOption("custom_minify_assets", "no").lower() in ("yes", "true", "1")
+
+    stage_assets(source, target, minify_text)
+    env.Replace(PROJECT_DATA_DIR=target)
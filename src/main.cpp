@@ -1,7 +1,9 @@
 #include <Arduino.h>
 #include <Wire.h>
 #include <WiFi.h>
-#include <WebServer.h>
+#include <HTTPClient.h>
+#include <AsyncTCP.h>
+#include <ESPAsyncWebServer.h>
 #include <SPIFFS.h>
 #include <LittleFS.h>
 #include <ArduinoJson.h>
@@ -9,6 +11,15 @@
 #include <Adafruit_Sensor.h>
 #include <Adafruit_SSD1306.h>
 #include <RTClib.h>
+#include <Preferences.h>
+#include <rom/crc.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <claybath_core.h>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+#include <new>
 
 // Pin definitions
 #define FILL_SOLENOID_PIN 25
@@ -18,6 +29,18 @@
 #define SCL_PIN 22             // I2C Bus 1 for MPU6050 and OLED1
 #define SDA2_PIN 18            // I2C Bus 2 for DS3231 and OLED2
 #define SCL2_PIN 19            // I2C Bus 2 for DS3231 and OLED2
+#define MPU_INT_PIN 4          // MPU6050 INT output (data ready, active high)
+
+// Probe channels: each is a chamber with its own probe, fill and empty valve.
+// The second MPU6050 sits on I2C Bus 1 as well, with AD0 pulled high.
+#ifndef PROBE_CHANNELS
+#define PROBE_CHANNELS 1 // Override in build_flags
+#endif
+#define MAX_PROBE_CHANNELS 2 // Two MPU6050 addresses on one bus
+#define PROBE2_MPU_ADDRESS 0x69
+#define PROBE2_INT_PIN 34    // Input only, fine for the INT line
+#define PROBE2_FILL_PIN 32
+#define PROBE2_EMPTY_PIN 33
 
 // I2C Addresses
 #define MPU6050_ADDRESS 0x68
@@ -28,31 +51,336 @@
 #define SCREEN_WIDTH 128
 #define SCREEN_HEIGHT 32
 #define OLED_RESET -1
+#define OLED_PAGES (SCREEN_HEIGHT / 8)
+
+// I2C bus management
+#ifndef I2C_CLOCK_HZ
+#define I2C_CLOCK_HZ 400000      // Starting clock for both buses (override in build_flags)
+#endif
+#define I2C_MIN_CLOCK_HZ 100000  // Fallback floor
+#define I2C_ERROR_WINDOW 500     // Transactions per error window
+#define I2C_ERROR_THRESHOLD 8    // Errors in one window that trigger a step down
+#define OLED_DATA_CHUNK 31             // Data bytes per I2C write, plus the control byte
+#define DISPLAY_FRAME_INTERVAL_MS 200  // Frame rate cap for both OLEDs
+#define DISPLAY_TASK_CORE 0
+#define DISPLAY_TASK_PRIORITY 1        // Below the sensor task, which wins I2C_1
+#define DISPLAY_TASK_STACK 4096
 #define OLED1_ADDRESS 0x3C
 #define OLED2_ADDRESS 0x3D
 
+// Sensor acquisition task configuration
+#define SAMPLE_RING_SIZE 1024 // Must be a power of two
+#define SENSOR_TASK_CORE 1
+#define SENSOR_TASK_PRIORITY 3 // Above loopTask (1) so web/display load can't delay sampling
+#define SENSOR_TASK_STACK 4096
+#define MIN_SAMPLE_RATE_HZ 100
+#define MAX_SAMPLE_RATE_HZ 1000
+#define FIFO_DRAIN_INTERVAL_MS 20 // FIFO holds 170 accel samples, ~170 ms at 1 kHz
+#define FIFO_BURST_BYTES 120      // Largest multiple of 6 that fits the 128 byte Wire buffer
+#define MPU_ACCEL_RANGE MPU6050_RANGE_8_G   // Every probe; the enum value is the AFS_SEL field
+#define MPU_ACCEL_RANGE_G (2 << MPU_ACCEL_RANGE) // +-8 g, recorded in capture headers
+
+// MPU6050 registers used by the acquisition task
+#define MPU_REG_SMPLRT_DIV 0x19
+#define MPU_REG_CONFIG 0x1A
+#define MPU_REG_GYRO_CONFIG 0x1B
+#define MPU_REG_ACCEL_CONFIG 0x1C
+#define MPU_REG_FIFO_EN 0x23
+#define MPU_REG_INT_ENABLE 0x38
+#define MPU_REG_INT_STATUS 0x3A
+#define MPU_REG_ACCEL_XOUT_H 0x3B
+#define MPU_REG_USER_CTRL 0x6A
+#define MPU_REG_FIFO_COUNT_H 0x72
+#define MPU_REG_FIFO_R_W 0x74
+#define MPU_REG_PWR_MGMT_1 0x6B
+#define MPU_REG_WHO_AM_I 0x75
+
+// Estimator, CORDIC and calibration table constants live in claybath_core.h
+
+// Persistent settings and state
+#define SETTINGS_FILE "/settings.bin"
+#define CHANNEL_SETTINGS_FILE "/settings_ch%d.bin" // Channels after the first
+#define SETTINGS_TEMP_FILE "/settings.tmp"
+#define LEGACY_SETTINGS_FILE "/settings.json"
+#define SETTINGS_MAGIC 0x47464343 // "CCFG"
+#define SETTINGS_VERSION 1
+#define STATE_NVS_NAMESPACE "claybath"
+#define STATE_COMMIT_DELAY_MS 60000 // Coalesce last-measurement writes to NVS
+#define CONFIG_MAX_VALVE_MS 1800000UL // Longest fill/empty/flush accepted by /api/config
+
+// Binary measurement log configuration
+#define LOG_DIR "/log"
+#define LOG_INDEX_FILE "/log/index.bin"
+#define LOG_SEGMENT_RECORDS 1024 // 24 KB per segment, about 3 weeks at 30 minute intervals
+#define LOG_MAX_SEGMENTS 32
+#define LOG_INDEX_MAGIC 0x474F4C43 // "CLOG"
+#define LOG_FORMAT_VERSION 1
+#define LOG_EMPTY_TIMESTAMP 0xFFFFFFFF // No timestamp / open end of a range
+#define LOG_NEXT_ID_NVS_KEY "logNextId"
+#define DATA_STREAM_CHUNK 1024         // /api/data per-request buffer
+#define DATA_STREAM_ROW_MAX 96         // Longest formatted CSV row
+
+// In-RAM file catalog behind /api/files, built once at boot
+#define CATALOG_MAX_FILES 256 // Root files, legacy per-day CSVs and log segments
+#define CATALOG_NAME_MAX 32
+#define CATALOG_PAGE_DEFAULT 50
+#define CATALOG_PAGE_MAX 200
+#define FILE_LIST_ROW_MAX 128 // Longest /api/files entry
+
+// Rollups served by /api/summary, rebuilt from the log at boot
+#define ROLLUP_HOURS 48
+#define ROLLUP_DAYS 62
+#define ROLLUP_BATCHES 16  // Most recent production batches kept
+#define BATCH_FILE "/batches.bin"
+#define BATCH_NAME_MAX 24
+
+// Raw trace capture (/api/capture)
+#define CAPTURE_FILE "/capture.bin"
+#define CAPTURE_MAX_SAMPLES 24576  // 240 KB, about 49 s at 500 Hz
+#define CAPTURE_BLOCK_SAMPLES 256  // One half of the double buffer, 256 ms at 1 kHz
+#define CAPTURE_FS_RESERVE 16384   // Free space left for the log and settings
+#define CAPTURE_SYNC_BYTES 16384   // Flush interval for live downloads; each flush copies the tail block
+#define CAPTURE_NOT_REACHED 0xFFFFFFFF
+#define CAPTURE_TASK_CORE 0
+#define CAPTURE_TASK_PRIORITY 1
+#define CAPTURE_TASK_STACK 4096
+
+// Station mode and batched upload to a central collector (/api/network)
+#define NETWORK_FILE "/network.bin"
+#define NETWORK_TEMP_FILE "/network.tmp"
+#define NETWORK_MAGIC 0x54454E43 // "CNET"
+#define NETWORK_VERSION 1
+#define NETWORK_URL_MAX 128
+#define UPLOAD_BATCH_RECORDS 64        // Records per POST, 1.5 KB of payload
+#define UPLOAD_INTERVAL_DEFAULT_S 300  // Longest a record waits for a full batch
+#define UPLOAD_RETRY_MIN_S 15          // First backoff after a failed upload, doubling from there
+#define UPLOAD_RETRY_MAX_S 900
+#define UPLOAD_HTTP_TIMEOUT_MS 5000
+#define UPLOAD_NVS_KEY "upload"
+#define UPLOAD_TASK_CORE 0
+#define UPLOAD_TASK_PRIORITY 1
+#define UPLOAD_TASK_STACK 6144         // HTTPClient and lwIP socket calls
+
+// Measurement record flags
+#define LOG_FLAG_CONVERGED 0x0001      // Stopped early on standard error
+#define LOG_FLAG_SETTLE_TIMEOUT 0x0002 // Settling hit waitDuration before the probe was stable
+#define LOG_FLAG_SAMPLES_DROPPED 0x0004 // Sample ring overran during the cycle
+#define LOG_FLAG_REPLICATE 0x0008      // One reading of a series
+#define LOG_FLAG_SERIES 0x0010         // Aggregate of a series (stddev across replicates)
+// Bits 12-15 hold the channel, see LOG_CHANNEL_SHIFT in claybath_core.h
+
+// Replicate series
+#define SERIES_MAX_REPLICATES 20
+
+// Control loop scheduling
+#define CONTROL_ACTIVE_INTERVAL_MS 20  // Sample draining while settling/measuring
+#define CONTROL_BUSY_MAX_WAIT_MS 250   // Longest sleep while a cycle is running
+#define CONTROL_IDLE_MAX_WAIT_MS 1000  // Longest sleep between cycles (clock, NVS, status)
+#define CPU_FREQ_ACTIVE_MHZ 240
+#define CPU_FREQ_IDLE_MHZ 80           // Lowest frequency that keeps the AP running
+
+// Runtime metrics (/api/metrics)
+#define METRICS_BUCKETS 20 // Bucket k counts durations below 2^k us, the last one is open-ended
+
+// Web server configuration
+#define CONTROL_QUEUE_LENGTH 16 // Must be a power of two
+#define CONTROL_BATCH_MAX 8      // Commands in one /api/control request
+#define CONTROL_RESULT_SLOTS 16  // Completed tokens kept for /api/control?token=
+#define MAX_REQUEST_BODY 1024
+#define API_JSON_CAPACITY (1536 + 256 * PROBE_CHANNELS) // Largest handler document (/api/status)
+#define EVENT_MAX_CLIENTS 4          // Concurrent /api/events streams
+#define EVENT_FRAME_MAX (320 + 512 * PROBE_CHANNELS) // Largest event, the "status" one
+#define EVENT_ANGLE_INTERVAL_MS 250  // Live angle event rate limit
+#define EVENT_RETRY_MS 2000          // Reconnect delay suggested to EventSource
+#define STATIC_CACHE_CONTROL "no-cache" // Revalidate each load; an unchanged page costs a 304
+
 // Serial logging buffer configuration
 #define SERIAL_BUFFER_SIZE 100 // Reduced buffer size
+#define SERIAL_LINE_MAX 272     // Worst case escaped line incl. timestamp prefix
+#define SERIAL_TASK_CORE 0
+#define SERIAL_TASK_PRIORITY 1
+#define SERIAL_TASK_STACK 3072
+
+// Time service
+#define CLOCK_RESYNC_INTERVAL_MS 60000 // DS3231 read interval, millis() in between
+#define SERIAL_JSON_OVERHEAD 128
 
 // Optimized circular buffer for serial messages
 struct LogMessage
 {
   unsigned long timestamp;
-  char message[80]; // Fixed size message buffer
+  uint32_t seq;     // Monotonic sequence number, survives ring wrap-around
+  char message[128]; // Fixed size message buffer, includes the "[HH:MM:SS] " stamp
 };
 
 LogMessage serialBuffer[SERIAL_BUFFER_SIZE];
 int serialBufferIndex = 0;
-int totalMessages = 0;
+int totalMessages = 0; // Valid entries in the ring, never more than SERIAL_BUFFER_SIZE
+uint32_t logSequence = 0; // Sequence number of the next log line
+TaskHandle_t serialTaskHandle = NULL; // Drains the ring to the UART
+
+// Software clock: last DS3231 reading extrapolated with millis()
+uint32_t clockBaseUnix = 0;
+unsigned long clockBaseMillis = 0;
+unsigned long lastClockSync = 0;
+portMUX_TYPE clockMux = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t serialBufferMutex = NULL; // Log lines come from several tasks
+
+// Acquisition modes for the sensor task
+enum AcquisitionMode
+{
+  ACQ_DATA_READY = 0, // One 6-byte accel burst per data-ready interrupt
+  ACQ_FIFO = 1        // Accel-only hardware FIFO drained in bursts
+};
+
+// Lock-free single-producer/single-consumer ring buffer.
+// Only the sensor task writes sampleHead, only the control loop writes sampleTail.
+AccelSample sampleRing[SAMPLE_RING_SIZE];
+std::atomic<uint32_t> sampleHead(0);
+std::atomic<uint32_t> sampleTail(0);
+volatile uint32_t sampleOverruns = 0;
+volatile bool mpuDataReadySeen = false; // Data-ready interrupt arrived since the last reconfigure; false = self-pacing
+volatile bool acquisitionReconfigure = false;
+TaskHandle_t sensorTaskHandle = NULL;
+std::atomic<uint8_t> requestedProbe(0); // Channel whose probe the control loop wants sampled
+std::atomic<uint8_t> sampledProbe(0);   // Channel the sensor task is sampling, set after switching
+// Per-channel sampling settings for the sensor task, rate << 8 | mode. Written
+// by the control loop (publishAcquisition), never read back from 'config',
+// which the control loop swaps between channels.
+std::atomic<uint32_t> channelAcquisition[PROBE_CHANNELS];
+uint8_t mpuAddress = MPU6050_ADDRESS;   // Sensor task only once it runs
+int sampledRateHz = 200;                // Sensor task only, as configured on the MPU6050
+uint8_t sampledMode = ACQ_FIFO;         // Sensor task only
+
+// Segment index entry: lets range queries seek straight to the right file
+struct __attribute__((packed)) LogSegmentInfo
+{
+  uint32_t id;
+  uint32_t firstTimestamp;
+};
+
+struct __attribute__((packed)) LogIndexHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+};
+
+// Read position in the measurement log
+struct LogCursor
+{
+  int segment;
+  uint32_t slot;
+  File file;
+};
+
+LogSegmentInfo logSegments[LOG_MAX_SEGMENTS];
+int logSegmentCount = 0;
+uint32_t logWriteSlot = 0;          // Records in the newest segment
+uint32_t logNextId = 1;             // Id of the next segment, kept in NVS so a clear never reuses one
+Preferences logPrefs;
+SemaphoreHandle_t logStoreMutex = NULL; // Control loop appends while web exports read
+
+// One file known to the catalog. Measurement files also carry the time range
+// of the data they hold, so range deletes need not open them.
+struct CatalogEntry
+{
+  char name[CATALOG_NAME_MAX]; // Full path
+  uint32_t size;
+  uint32_t lastModified;
+  uint32_t dataFrom; // Unix time, 0 = not a measurement file
+  uint32_t dataTo;
+};
+
+// Sorted by name; the firmware updates it on every file it writes or removes
+CatalogEntry fileCatalog[CATALOG_MAX_FILES];
+int catalogCount = 0;
+portMUX_TYPE catalogMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Page asset in LittleFS. buildfs stores text assets as <path>.gz (see
+// scripts/compress_assets.py); the ETag is the CRC of the stored file.
+struct StaticAsset
+{
+  const char *path;
+  const char *contentType;
+  bool gzipped;
+  char etag[12]; // Quoted hex CRC, empty = file missing
+};
+
+StaticAsset staticAssets[] = {
+    {"/index.html", "text/html", false, ""},
+};
+
+// Chunked /api/files state
+struct FileListStream
+{
+  int first;
+  int next;
+  int end;
+  int stage; // 1 entries (after the preformatted header), 2 closing bracket, 3 done
+  char buffer[DATA_STREAM_CHUNK];
+  size_t length;
+  size_t offset;
+};
 
 // Global objects
 Adafruit_MPU6050 mpu;
 TwoWire I2C_1 = TwoWire(0); // I2C Bus 1 for MPU6050 and OLED1
+SemaphoreHandle_t i2c1Mutex = NULL; // Bus arbiter, held per transaction so sensor reads get in between OLED writes
 TwoWire I2C_2 = TwoWire(1); // I2C Bus 2 for DS3231 and OLED2
-Adafruit_SSD1306 display1(SCREEN_WIDTH, SCREEN_HEIGHT, &I2C_1, OLED_RESET);
-Adafruit_SSD1306 display2(SCREEN_WIDTH, SCREEN_HEIGHT, &I2C_2, OLED_RESET);
+SemaphoreHandle_t i2c2Mutex = NULL; // Same for Bus 2: display task pushes OLED2, control loop reads the RTC
+// The library restores 'clkAfter' after each of its own transactions, so keep it at our rate
+Adafruit_SSD1306 display1(SCREEN_WIDTH, SCREEN_HEIGHT, &I2C_1, OLED_RESET, I2C_CLOCK_HZ, I2C_CLOCK_HZ);
+Adafruit_SSD1306 display2(SCREEN_WIDTH, SCREEN_HEIGHT, &I2C_2, OLED_RESET, I2C_CLOCK_HZ, I2C_CLOCK_HZ);
+
+// Per-bus transaction counters, reported in /api/status
+struct I2cBusStats
+{
+  uint32_t clockHz;
+  uint32_t transactions;
+  uint32_t nacks;
+  uint32_t timeouts;
+  uint32_t windowTransactions;
+  uint32_t windowErrors;
+  uint8_t stepDowns;
+};
+
+I2cBusStats i2cStats[2] = {{I2C_CLOCK_HZ}, {I2C_CLOCK_HZ}};
+
+// Timed stages of the control loop and the tasks around it
+enum MetricId
+{
+  METRIC_CLOCK,
+  METRIC_STATE_STORE,
+  METRIC_COMMANDS,
+  METRIC_MEASUREMENT,
+  METRIC_RELAYS,
+  METRIC_PUBLISH,
+  METRIC_LOOP,          // Busy part of one loop() pass
+  METRIC_WAIT,          // Blocking wait for the next deadline or command
+  METRIC_DISPLAY,       // One display frame (display task)
+  METRIC_SAMPLE_JITTER, // |sample interval - configured period| (sensor task)
+  METRIC_COUNT
+};
+
+const char *const metricNames[METRIC_COUNT] = {
+    "clock", "state_store", "commands", "measurement", "relays",
+    "publish", "loop", "wait", "display", "sample_jitter"};
+
+// Fixed log2 buckets: recording is a count-leading-zeros and an increment
+struct MetricHistogram
+{
+  uint32_t buckets[METRICS_BUCKETS];
+  uint32_t count;
+  uint64_t sumUs;
+  uint32_t maxUs;
+};
+
+MetricHistogram metrics[METRIC_COUNT];
+portMUX_TYPE metricsMux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t lastSampleUs = 0; // Sensor task only; 0 restarts the interval after reconfiguring
 RTC_DS3231 rtc;
-WebServer server(80);
+AsyncWebServer server(80);
 
 // Add these global variables for non-blocking measurement
 enum MeasurementState
@@ -62,212 +390,869 @@ enum MeasurementState
   FILLING,
   WAITING_TO_SETTLE,
   MEASURING,
-  EMPTYING_FINAL
+  EMPTYING_FINAL,
+  EXCHANGING // Series: drain and refill together between replicates
 };
 
 MeasurementState measurementState = IDLE;
 unsigned long stateStartTime = 0;
-float angleSum = 0.0;
-int validReadings = 0;
-int measurementCount = 0;
+MeasurementAccumulator reading; // Statistics of the replicate being measured
+
+// Adaptive settle detection: one-second windows of live angle statistics
+AngleEstimator settleWindow;
+unsigned long settleWindowStart = 0;
+float settlePreviousMean = NAN;
+int settleStableSeconds = 0;
+uint16_t measurementFlags = 0;
 unsigned long lastAngleReadTime = 0;
 
+// Replicate series: running mean/variance of the per-replicate results
+int seriesTarget = 1;
+int seriesIndex = 0; // Replicate currently running, 0-based
+int seriesCount = 0; // Replicates with a valid result
+double seriesDensityMean = 0.0;
+double seriesAngleMean = 0.0;
+double seriesAngleM2 = 0.0;
+uint32_t seriesSamples = 0;
+uint16_t seriesFlags = 0;
+
 // Updated Configuration structure with angle ranges
 struct Config
 {
   float desiredDensity = 1.025;
   int measurementInterval = 30; // minutes
-  int fillDuration = 5;         // seconds
+  uint32_t fillDurationMs = 5000; // milliseconds, timed by the valve timer
   int waitDuration = 60;        // seconds
   int measurementDuration = 10; // seconds
-  int emptyDuration = 120;      // seconds
+  uint32_t emptyDurationMs = 120000; // milliseconds, timed by the valve timer
+  int sampleRateHz = 200;       // MPU6050 acquisition rate (100-1000 Hz)
+  int acquisitionMode = ACQ_FIFO;
+  float convergenceThreshold = 0.02; // degrees standard error for early stop, 0 = full duration
+  int settleStableSeconds = 5;       // stable seconds required before measuring, 0 = fixed wait
+  float settleThreshold = 0.05;      // degrees, max stddev and drift of a stable second
   float calibrationOffset = 0.0;
   float calibrationScale = 1.0;
+  int calibrationPointCount = 0;                 // 2+ points replace the linear offset/scale formula
+  float calibrationAngles[CAL_MAX_POINTS] = {};    // Raw probe angle, ascending
+  float calibrationDensities[CAL_MAX_POINTS] = {}; // Reference density at that angle
   float lastMeasurementValue = 0.0;
   unsigned long lastMeasurementTime = 0; // Unix timestamp
   float targetAngleMin = 40.0;
   float targetAngleMax = 45.0;
   float lastMeasurementAngle = 0.0;
   bool autoMeasurementEnabled = false; // NEW: Default to disabled
+  int seriesReplicates = 1;            // Readings per automatic cycle
+  uint32_t seriesFlushMs = 30000;      // Drain with the fill valve open between replicates
 } config;
 
+// On-flash settings: header, then the packed settings. New fields are only
+// appended, so a shorter payload written by older firmware keeps the defaults
+// for the fields it doesn't have.
+struct __attribute__((packed)) SettingsHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t size; // Payload bytes that follow
+  uint32_t crc;  // CRC32 of the payload
+};
+
+struct __attribute__((packed)) SettingsPayload
+{
+  float desiredDensity;
+  uint16_t measurementInterval;
+  uint16_t fillDuration;
+  uint16_t waitDuration;
+  uint16_t measurementDuration;
+  uint16_t emptyDuration;
+  uint16_t sampleRateHz;
+  uint8_t acquisitionMode;
+  uint8_t autoMeasurementEnabled;
+  uint16_t settleStableSeconds;
+  float convergenceThreshold;
+  float settleThreshold;
+  float calibrationOffset;
+  float calibrationScale;
+  float targetAngleMin;
+  float targetAngleMax;
+  uint8_t calibrationPointCount;
+  float calibrationAngles[CAL_MAX_POINTS];
+  float calibrationDensities[CAL_MAX_POINTS];
+  uint32_t fillDurationMs;  // Supersede the whole-second fields above,
+  uint32_t emptyDurationMs; // which are still written for older firmware
+  uint8_t seriesReplicates;
+  uint32_t seriesFlushMs;
+};
+
+// Last measurement, kept in NVS apart from the settings because it changes every cycle
+struct __attribute__((packed)) LastMeasurementState
+{
+  uint32_t time;
+  float density;
+  float angle;
+};
+
+Preferences statePrefs;
+bool measurementStateDirty = false;
+unsigned long measurementStateDirtySince = 0;
+
 // Global variables
 float currentAngle = 0.0;
+float liveAngle = 0.0; // Most recent sample angle
 float currentDensity = 0.0;
+uint16_t channelLuts[PROBE_CHANNELS][CAL_LUT_SIZE];
+uint16_t *calibrationLut = channelLuts[0]; // Density per raw angle step, see buildCalibrationLut()
 float lastMeasurement = 0.0;
+float lastMeasurementStdDev = 0.0;
+uint32_t lastMeasurementSamples = 0;
 DateTime lastMeasurementTime;
 DateTime nextMeasurementTime;
 bool isMeasuring = false;
 bool isManualMode = false;
 unsigned long lastMeasurementMillis = 0;
+uint32_t cpuFrequencyMhz = CPU_FREQ_ACTIVE_MHZ;
+
+// Valve sequencing: each solenoid has a one-shot esp_timer that closes it on
+// time, the state machine only observes 'closed'. Separate timers let the fill
+// and empty valves overlap between replicates.
+struct ValveTimer
+{
+  int pin;
+  esp_timer_handle_t timer;
+  volatile bool closed;
+  volatile int64_t openedUs;
+  volatile int64_t closedUs;
+  uint64_t durationUs;       // 64-bit like esp_timer; ms * 1000 wraps 32 bits at ~71 min
+  uint32_t runs;             // Timed runs that closed on the timer
+  volatile int32_t errorUs;  // Actual minus configured open time of the last run
+  volatile int32_t maxErrorUs;
+};
+
+ValveTimer channelValves[PROBE_CHANNELS][2]; // Fill, empty; set up by initValveTimers()
+ValveTimer *fillValve = &channelValves[0][0];
+ValveTimer *emptyValve = &channelValves[0][1];
 bool rtcAvailable = false;
 
+// Wiring of each probe channel
+struct ProbeHardware
+{
+  uint8_t mpuAddress;
+  int intPin;
+  int fillPin;
+  int emptyPin;
+};
+
+static_assert(PROBE_CHANNELS >= 1 && PROBE_CHANNELS <= MAX_PROBE_CHANNELS, "PROBE_CHANNELS out of range");
+const ProbeHardware probeHardware[MAX_PROBE_CHANNELS] = {
+    {MPU6050_ADDRESS, MPU_INT_PIN, FILL_SOLENOID_PIN, EMPTY_SOLENOID_PIN},
+    {PROBE2_MPU_ADDRESS, PROBE2_INT_PIN, PROBE2_FILL_PIN, PROBE2_EMPTY_PIN}};
+bool channelPresent[PROBE_CHANNELS] = {true}; // Probe answered at boot; channel 0 is required
+
+// Per-channel measurement state. The state machine works on the globals above;
+// channel 0 lives there permanently and selectChannel() swaps another channel's
+// context in and out around its turn (control loop only).
+struct ChannelContext
+{
+  Config config;
+  uint16_t *calibrationLut;
+  ValveTimer *fillValve;
+  ValveTimer *emptyValve;
+  MeasurementState measurementState;
+  unsigned long stateStartTime;
+  MeasurementAccumulator reading;
+  AngleEstimator settleWindow;
+  unsigned long settleWindowStart;
+  float settlePreviousMean;
+  int settleStableSeconds;
+  uint16_t measurementFlags;
+  unsigned long lastAngleReadTime;
+  int seriesTarget;
+  int seriesIndex;
+  int seriesCount;
+  double seriesDensityMean;
+  double seriesAngleMean;
+  double seriesAngleM2;
+  uint32_t seriesSamples;
+  uint16_t seriesFlags;
+  float currentAngle;
+  float liveAngle;
+  float currentDensity;
+  float lastMeasurement;
+  float lastMeasurementStdDev;
+  uint32_t lastMeasurementSamples;
+  DateTime lastMeasurementTime;
+  DateTime nextMeasurementTime;
+  bool isMeasuring;
+};
+
+ChannelContext channelContexts[PROBE_CHANNELS]; // [0] holds channel 0 while another is selected
+int activeChannel = 0; // Channel whose context is in the globals
+int sensorOwner = -1;  // Channel holding the sampling lease, see claimSensor()
+bool sensorSwitching = false; // Lease moved to another probe, samples not yet from it
+
+// Commands posted by web handlers (async_tcp task) for the control loop
+enum ControlCommandType
+{
+  CMD_MEASURE,
+  CMD_RELAY,
+  CMD_UPDATE_CONFIG,
+  CMD_SET_TIME,
+  CMD_DELETE_DATA,
+  CMD_DELETE_RANGE,
+  CMD_CAPTURE,
+  CMD_NEW_BATCH
+};
+
+enum RelayTarget
+{
+  RELAY_FILL,
+  RELAY_EMPTY,
+  RELAY_MEASURING
+};
+
+struct ControlCommand
+{
+  ControlCommandType type;
+  uint8_t relay;
+  bool state;
+  uint32_t unixTime;
+  uint32_t rangeEnd; // CMD_DELETE_RANGE: data from unixTime to rangeEnd
+  uint32_t durationMs; // CMD_RELAY: close the valve again after this long, 0 = stay
+  uint8_t replicates;
+  char name[BATCH_NAME_MAX];
+  Config config;
+  uint32_t token;  // Completion token, shared by the commands of a batch
+  bool batchEnd;   // Last command of its batch
+  uint8_t channel = 0; // Probe channel the command is applied to
+};
+
+// Lock-free command ring. The web handlers are the only producer (they all run
+// on the async_tcp task), the control loop the only consumer. A batch becomes
+// visible with a single store of commandHead, so it is applied in one pass.
+ControlCommand commandRing[CONTROL_QUEUE_LENGTH];
+std::atomic<uint32_t> commandHead(0);
+std::atomic<uint32_t> commandTail(0);
+uint32_t nextCommandToken = 1; // Producer only
+TaskHandle_t controlTaskHandle = NULL; // Woken when commands are published
+
+// Outcome of a finished batch, looked up by token (slot token % CONTROL_RESULT_SLOTS)
+struct CommandResult
+{
+  uint32_t token;
+  const char *error; // Static string, NULL = applied
+};
+
+CommandResult commandResults[CONTROL_RESULT_SLOTS];
+uint32_t completedToken = 0; // Newest finished token; tokens finish in order
+portMUX_TYPE commandResultMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Request and response document of the web handlers. They all run one at a
+// time on the async_tcp task, so one preallocated document serves them all.
+StaticJsonDocument<API_JSON_CAPACITY> apiDoc;
+
+// Per-channel part of the published state
+struct ChannelStatus
+{
+  uint8_t measurementState;
+  bool isMeasuring;
+  bool autoMeasurementEnabled;
+  uint8_t seriesIndex;
+  uint8_t seriesTarget;
+  float lastMeasurement;
+  float lastMeasurementAngle;
+  uint32_t lastMeasurementTime;
+  uint32_t nextMeasurementTime;
+};
+
+// State published by the control loop for the web handlers. The top-level
+// fields describe channel 0.
+struct StatusSnapshot
+{
+  float currentAngle;
+  float currentDensity;
+  float liveAngle;
+  float liveDensity;
+  float lastMeasurement;
+  float lastMeasurementStdDev;
+  uint32_t lastMeasurementSamples;
+  uint32_t nextMeasurementTime;
+  uint8_t measurementState;
+  unsigned long stateStartTime;
+  uint8_t seriesIndex;
+  uint8_t seriesTarget;
+  bool isMeasuring;
+  bool isManualMode;
+  Config config;
+  ChannelStatus channels[PROBE_CHANNELS];
+};
+
+StatusSnapshot statusSnapshot;
+Config publishedConfigs[PROBE_CHANNELS]; // Settings of every channel, under statusMux
+portMUX_TYPE statusMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Per-connection state of /api/events. The stream is a chunked response whose
+// filler runs on the async_tcp task whenever the connection can take more, so
+// each client follows its own log cursor and nothing is queued or dropped.
+int eventClients = 0; // async_tcp task only
+
+struct EventStreamState
+{
+  uint32_t logSeq;      // Next log line for this client
+  uint32_t statusKey;   // CRC of the fields whose change triggers a status event
+  bool statusSent;
+  float lastAngle;
+  unsigned long lastAnglePush;
+  char event[EVENT_FRAME_MAX]; // Formatted event being copied out
+  size_t length;
+  size_t offset;
+
+  ~EventStreamState()
+  {
+    eventClients--;
+  }
+};
+
+// Per-request state of a chunked /api/data export
+struct DataStreamState
+{
+  uint32_t from;
+  uint32_t to;
+  int stage; // 0 header, 1 legacy CSV files, 2 binary log, 3 done
+  int catalogIndex;
+  File legacy;
+  LogCursor cursor;
+  bool seeked;
+  char buffer[DATA_STREAM_CHUNK];
+  size_t length;
+  size_t offset;
+};
+
+// Production batch; measurements from 'start' on belong to it until the next one
+struct __attribute__((packed)) BatchInfo
+{
+  uint32_t id;
+  uint32_t start; // Unix time
+  char name[BATCH_NAME_MAX];
+};
+
+// Density rollups, updated as records are written. Written by the control loop,
+// read by /api/summary; both sides hold rollupMux.
+RollupBucket hourlyRollup[ROLLUP_HOURS];
+RollupBucket dailyRollup[ROLLUP_DAYS];
+BatchInfo batches[ROLLUP_BATCHES]; // Oldest first
+RollupBucket batchRollup[ROLLUP_BATCHES];
+int batchCount = 0;
+portMUX_TYPE rollupMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Raw trace capture: the control loop copies samples into one half of a
+// double buffer while the capture task writes the other half to flash, so a
+// slow flash write costs dropped capture samples, never sampling time.
+enum CaptureState
+{
+  CAPTURE_OFF,
+  CAPTURE_PREPARING, // Capture task creating the file
+  CAPTURE_ARMED,     // Waiting for the next cycle to start settling
+  CAPTURE_RUNNING,
+  CAPTURE_FINISHING, // Capture task writing the last blocks and the header
+  CAPTURE_DONE
+};
+
+struct CaptureBlock
+{
+  TraceSample samples[CAPTURE_BLOCK_SAMPLES];
+  uint16_t count;
+  std::atomic<bool> full; // Set by the control loop, cleared by the capture task
+};
+
+std::atomic<uint8_t> captureState(CAPTURE_OFF);
+CaptureBlock *captureBlocks = NULL;      // Two blocks, allocated on first use
+int captureFillBlock = 0;                // Control loop only
+uint32_t captureQueued = 0;              // Samples handed to blocks, control loop only
+uint32_t captureDropped = 0;             // Control loop only
+std::atomic<uint32_t> captureCapacity(0); // Set by the capture task when preparing
+std::atomic<uint32_t> captureWritten(0); // Samples on flash, capture task only
+std::atomic<uint32_t> captureSynced(0);  // Of those, flushed and visible to readers
+TraceHeader captureHeader;               // Control loop until FINISHING, then the capture task
+TaskHandle_t captureTaskHandle = NULL;
+
+// Station mode: joins the plant network next to the AP and posts new log
+// records to a collector. networkConfig belongs to the upload task after boot;
+// web handlers read and change requestedNetwork under uploadMux.
+struct __attribute__((packed)) NetworkConfig
+{
+  uint8_t enabled;
+  char ssid[33];
+  char password[65];
+  char collectorUrl[NETWORK_URL_MAX]; // http://host[:port]/path
+  uint16_t uploadIntervalS;
+};
+
+// Acknowledged high-water mark, kept in NVS: the collector has every record
+// before slot 'index' of log segment 'segmentId'. Segments are append-only and
+// ids only grow, so the mark holds across clock steps that reorder timestamps.
+struct __attribute__((packed)) UploadMark
+{
+  uint32_t segmentId;
+  uint32_t index;
+};
+
+// Uploader progress for /api/network, under uploadMux
+struct UploadStatus
+{
+  UploadMark acked;
+  uint32_t lastUpload; // Unix time of the last acknowledged batch
+  uint32_t records;    // Acknowledged since boot
+  uint32_t batches;
+  uint32_t failures;
+  int lastHttpCode;    // 0 = nothing sent yet, negative = HTTPClient error
+  uint32_t retryS;     // Current backoff, 0 = none
+};
+
+NetworkConfig networkConfig;
+NetworkConfig requestedNetwork;
+bool networkChanged = false;
+UploadStatus uploadStatus = {};
+portMUX_TYPE uploadMux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t uploadTaskHandle = NULL;
+Preferences uploadPrefs; // Upload task only
+uint8_t uploadBuffer[sizeof(UploadHeader) + UPLOAD_BATCH_RECORDS * sizeof(LogRecord)]; // Upload task only
+
 unsigned long lastDisplayUpdate = 0;
 int displayPage = 0; // 0 or 1 for alternating pages
 
+// Copy of the frame last sent to a panel, used to push only changed pages
+struct OledShadow
+{
+  uint8_t pages[OLED_PAGES][SCREEN_WIDTH];
+  bool valid;
+};
+
+OledShadow oledShadow1 = {};
+OledShadow oledShadow2 = {};
+
 // Function prototypes
 void initializeSystem();
 void loadConfig();
+bool loadSettingsBlob();
+bool loadLegacyConfig();
 void saveConfig();
 void createDefaultConfig();
+void restoreLastMeasurement();
+void markMeasurementStateDirty();
+void commitMeasurementState();
+void serviceStateStore();
+bool readNewestLogRecord(LogRecord &record, int channel = -1);
 void calculateNextMeasurementTime();
 void setupWiFiHotspot();
 void setupWebServer();
-void handleWebRequests();
-void performMeasurement();
+void setupStaticAssets();
+void serveStaticAsset(AsyncWebServerRequest *request, const StaticAsset &asset);
+void processControlCommands();
+const char *applyControlCommand(const ControlCommand &command);
+const char *invalidConfigField(const Config &settings);
+void repairConfigFields(Config &settings);
+void publishStatus();
+void setupEventSource();
+void performMeasurement(int replicates = 1);
+void beginReplicate();
+void enterSettling(unsigned long now);
+void addSeriesResult(float density, float angle, uint32_t samples, uint16_t flags);
+void finishSeries();
 void controlRelays();
-void updateDisplays();
-void saveMeasurementData(float density, float angle, DateTime timestamp);
-String getMeasurementData();
+void initValveTimers();
+void openValveFor(ValveTimer &valve, uint32_t durationMs);
+void cancelValve(ValveTimer &valve);
+uint32_t controlWaitMs();
+uint32_t stepChannels();
+void swapChannelContext(int channel);
+void selectChannel(int channel);
+bool claimSensor();
+void releaseSensor();
+bool anyChannelMeasuring();
+void initChannels();
+bool initProbe(uint8_t address);
+void updatePowerMode();
+void updateDisplays(const StatusSnapshot &status);
+int pushDisplayChanges(Adafruit_SSD1306 &display, TwoWire &bus, OledShadow &shadow, SemaphoreHandle_t busMutex);
+void startDisplayTask();
+void i2c1Lock();
+void i2c1Unlock();
+void i2c2Lock();
+void i2c2Unlock();
+void recordI2cResult(TwoWire &bus, uint8_t error);
+I2cBusStats readI2cStats(int index);
+void recordMetric(MetricId id, uint32_t us);
+int64_t recordStage(MetricId id, int64_t sinceUs);
+void setupMetricsEndpoint();
+void armCapture(bool enable);
+void startCapture();
+void captureSample(const AccelSample &sample);
+void markCaptureMeasureStart();
+void stopCapture();
+void startCaptureTask();
+void setupCaptureEndpoints();
+void saveMeasurementData(float density, float angle, float stddev, uint32_t samples, uint16_t flags,
+                         DateTime timestamp, uint16_t replicates = 0);
+void initMeasurementLog();
+bool appendLogRecord(const LogRecord &record);
+bool appendLogRecordLocked(const LogRecord &record);
+uint32_t logRecordCount();
+void logSeek(LogCursor &cursor, uint32_t from);
+bool logNext(LogCursor &cursor, LogRecord &record);
 void deleteMeasurementData();
+void deleteMeasurementRange(uint32_t from, uint32_t to);
+void addToRollups(const LogRecord &record);
+void clearRollups();
+void rebuildRollups();
+void loadBatches();
+void saveBatches();
+void startBatch(const char *name);
+void setupSummaryEndpoints();
+void loadNetworkConfig();
+bool saveNetworkConfig(const NetworkConfig &settings);
+void applyStationMode();
+int readUploadBatch(const UploadMark &from, LogRecord *records, int max, UploadMark &next);
+int postUploadBatch(int count);
+void startUploadTask();
+void setupNetworkEndpoints();
 float angleToDensity(float angle);
+float calibrationCurve(const Config &settings, float angle);
+void buildCalibrationLut();
+bool setCalibrationPoints(Config &settings, JsonArrayConst points);
 void calibrateMPU();
 void setDateTime(int year, int month, int day, int hour, int minute, int second);
 void scanI2CDevices();
 bool checkRTCConnection();
 bool checkMPUConnection();
 void updateMeasurementState();
-void logSerial(String message);
-String getFileList();
+void logSerial(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void buildFileCatalog();
+void catalogUpdate(const char *name, uint32_t size, uint32_t dataFrom = 0, uint32_t dataTo = 0);
+void catalogRemove(const char *name);
+bool catalogEntry(int index, CatalogEntry &entry);
+bool catalogFind(const char *name, CatalogEntry &entry);
+int catalogSize();
+bool isLegacyDataFile(const char *name);
+size_t fillFileList(FileListStream &stream, uint8_t *buffer, size_t maxLen);
 bool deleteFile(String filename);
 String getFileInfo(String filename);
+bool isProtectedFile(const char *name);
+int listedFileCount();
+int listedCatalogIndex(int position);
 String formatTime(DateTime dt);
-void handleSerial();
+void handleSerial(AsyncWebServerRequest *request);
 void setupEnhancedSerialEndpoints();
 void serialPrintln(const char *message);
-void handleSerialText();
+void storeSerialLine(const char *line);
+uint32_t oldestSerialSeq();
+const LogMessage &serialEntry(uint32_t seq);
+void startSerialTask();
+void setClockBase(uint32_t unixTime);
+void setClock(uint32_t unixTime);
+bool syncClock();
+void serviceClock();
+uint32_t nowUnix();
+DateTime nowDateTime();
+void handleSerialText(AsyncWebServerRequest *request);
 void clearSerialBuffer();
+void startSensorTask();
+void configureAcquisition();
+void publishAcquisition(int channel, const Config &settings);
+int achievableSampleRate(int hz);
+bool popSample(AccelSample &sample);
+void discardSamples();
+
+// printf-style logging: formats on the stack, stamps from the cached clock and
+// stores into the ring. The UART copy is written later by serialDrainTask, so
+// callers never allocate or block on the serial port.
+void logSerial(const char *format, ...)
+{
+  char line[sizeof(LogMessage::message)];
+  uint32_t unixTime = nowUnix();
+  int prefix;
+
+  if (unixTime > 0)
+  {
+    uint32_t seconds = unixTime % 86400;
+    prefix = snprintf(line, sizeof(line), "[%02u:%02u:%02u] ",
+                      (unsigned)(seconds / 3600), (unsigned)(seconds / 60 % 60), (unsigned)(seconds % 60));
+  }
+  else
+  {
+    prefix = snprintf(line, sizeof(line), "[??:??:??] ");
+  }
+
+  // Lines from another channel's turn in the control loop name it
+  if (activeChannel > 0 && xTaskGetCurrentTaskHandle() == controlTaskHandle)
+  {
+    prefix += snprintf(line + prefix, sizeof(line) - prefix, "ch%d: ", activeChannel);
+  }
 
-// Enhanced logSerial function with better formatting and timestamp handling
-void logSerial(String message)
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line + prefix, sizeof(line) - prefix, format, args);
+  va_end(args);
+
+  storeSerialLine(line);
+}
+
+// Rebase the software clock; later readings are extrapolated from millis()
+void setClockBase(uint32_t unixTime)
 {
-  DateTime now;
-  String timestampStr;
+  portENTER_CRITICAL(&clockMux);
+  clockBaseMillis = millis();
+  clockBaseUnix = unixTime;
+  portEXIT_CRITICAL(&clockMux);
+}
 
+// Set the DS3231 (when present) and the software clock together
+void setClock(uint32_t unixTime)
+{
   if (rtcAvailable)
   {
-    now = rtc.now();
-    timestampStr = formatTime(now);
+    i2c2Lock();
+    rtc.adjust(DateTime(unixTime));
+    i2c2Unlock();
   }
-  else
+  setClockBase(unixTime);
+}
+
+// Read the DS3231 once and rebase the software clock on it
+bool syncClock()
+{
+  lastClockSync = millis();
+  if (!rtcAvailable)
+    return false;
+
+  i2c2Lock();
+  DateTime now = rtc.now();
+  bool garbled = now.year() < 2000 || now.year() > 2099;
+  if (garbled)
   {
-    timestampStr = "??:??:??";
+    recordI2cResult(I2C_2, 4);
   }
+  i2c2Unlock();
+  if (garbled)
+  {
+    return false; // Garbled read, keep extrapolating
+  }
+  setClockBase(now.unixtime());
+  return true;
+}
+
+// Called from loop(): the only periodic DS3231 access
+void serviceClock()
+{
+  if (millis() - lastClockSync >= CLOCK_RESYNC_INTERVAL_MS)
+  {
+    syncClock();
+  }
+}
+
+// Cheap wall clock for the rest of the firmware, 0 until the clock has been set
+uint32_t nowUnix()
+{
+  portENTER_CRITICAL(&clockMux);
+  uint32_t base = clockBaseUnix;
+  unsigned long baseMillis = clockBaseMillis;
+  portEXIT_CRITICAL(&clockMux);
+
+  if (base == 0)
+    return 0;
+  return base + (millis() - baseMillis) / 1000;
+}
+
+DateTime nowDateTime()
+{
+  return DateTime(nowUnix());
+}
+
+// Low-priority task copying new ring entries to the UART
+void serialDrainTask(void *param)
+{
+  uint32_t cursor = 0;
+  char line[sizeof(LogMessage::message)];
+
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    for (;;)
+    {
+      uint32_t dropped = 0;
+      xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
+      uint32_t oldest = oldestSerialSeq();
+      if (cursor < oldest)
+      {
+        // Logging outran the UART; the overwritten lines are lost
+        dropped = oldest - cursor;
+        cursor = oldest;
+      }
+      bool available = cursor < logSequence;
+      if (available)
+      {
+        memcpy(line, serialEntry(cursor).message, sizeof(line));
+        cursor++;
+      }
+      xSemaphoreGive(serialBufferMutex);
 
-  // Create the complete log message with milliseconds for better precision
-  String logMessage = "[" + timestampStr + "] " + message;
+      if (dropped)
+        Serial.printf("[serial] %u lines dropped\n", (unsigned)dropped);
+      if (!available)
+        break;
+      Serial.println(line);
+    }
+  }
+}
 
-  // Print to both Serial (PlatformIO terminal) and web buffer
-  Serial.println(logMessage);
+void startSerialTask()
+{
+  xTaskCreatePinnedToCore(serialDrainTask, "serial", SERIAL_TASK_STACK, NULL,
+                          SERIAL_TASK_PRIORITY, &serialTaskHandle, SERIAL_TASK_CORE);
+}
 
-  // Add to circular buffer for web interface
-  strncpy(serialBuffer[serialBufferIndex].message, logMessage.c_str(), 79);
-  serialBuffer[serialBufferIndex].message[79] = '\0'; // Ensure null termination
-  serialBuffer[serialBufferIndex].timestamp = millis();
+// Append one formatted line to the web ring buffer
+void storeSerialLine(const char *line)
+{
+  if (serialBufferMutex)
+    xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
+  LogMessage &entry = serialBuffer[serialBufferIndex];
+  strncpy(entry.message, line, sizeof(entry.message) - 1);
+  entry.message[sizeof(entry.message) - 1] = '\0'; // Ensure null termination
+  entry.timestamp = millis();
+  entry.seq = logSequence++;
 
   serialBufferIndex = (serialBufferIndex + 1) % SERIAL_BUFFER_SIZE;
-  totalMessages++;
+  if (totalMessages < SERIAL_BUFFER_SIZE)
+    totalMessages++;
+  if (serialBufferMutex)
+    xSemaphoreGive(serialBufferMutex);
+
+  if (serialTaskHandle)
+    xTaskNotifyGive(serialTaskHandle);
+}
+
+// Sequence number of the oldest line still in the ring (caller holds the mutex)
+uint32_t oldestSerialSeq()
+{
+  return logSequence - totalMessages;
 }
 
-// Enhanced function to get serial buffer for web interface with proper ordering
-String getSerialBuffer()
+// Ring entry holding line 'seq', which must be buffered (caller holds the mutex)
+const LogMessage &serialEntry(uint32_t seq)
 {
-  String result = "";
-  result.reserve(SERIAL_BUFFER_SIZE * 100); // Pre-allocate space for better performance
+  return serialBuffer[(serialBufferIndex + SERIAL_BUFFER_SIZE - (logSequence - seq)) % SERIAL_BUFFER_SIZE];
+}
 
-  int start = (serialBufferIndex - min(totalMessages, SERIAL_BUFFER_SIZE) + SERIAL_BUFFER_SIZE) % SERIAL_BUFFER_SIZE;
-  int count = min(totalMessages, SERIAL_BUFFER_SIZE);
+// Copy whole lines from 'since' onwards into 'buffer', JSON-escaped when
+// 'json' is set. 'since' is advanced past the last line that fit.
+size_t copySerialLines(uint32_t &since, char *buffer, size_t length, bool json, bool timestamps)
+{
+  size_t used = 0;
 
-  for (int i = 0; i < count; i++)
+  xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
+  if (since < oldestSerialSeq() || since > logSequence)
+    since = oldestSerialSeq();
+
+  while (since < logSequence)
   {
-    int index = (start + i) % SERIAL_BUFFER_SIZE;
-    result += serialBuffer[index].message;
-    result += "\n";
+    const LogMessage &entry = serialEntry(since);
+    char line[SERIAL_LINE_MAX];
+    size_t n = timestamps ? snprintf(line, sizeof(line), "%lu: ", entry.timestamp) : 0;
+
+    for (const char *c = entry.message; *c; c++)
+    {
+      if (json && (*c == '"' || *c == '\\'))
+        line[n++] = '\\';
+      line[n++] = (json && (uint8_t)*c < 0x20) ? ' ' : *c;
+    }
+    if (json)
+      line[n++] = '\\', line[n++] = 'n';
+    else
+      line[n++] = '\n';
+
+    if (used + n > length)
+      break;
+    memcpy(buffer + used, line, n);
+    used += n;
+    since++;
   }
+  xSemaphoreGive(serialBufferMutex);
 
-  return result;
+  return used;
+}
+
+// Lines a client resuming at 'since' has to fetch; 'resumed' is false when
+// its cursor fell off the ring (or predates a reboot) and the output restarts
+int pendingSerialLines(uint32_t since, bool &resumed)
+{
+  xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
+  uint32_t oldest = oldestSerialSeq();
+  resumed = since >= oldest && since <= logSequence;
+  int pending = logSequence - (resumed ? since : oldest);
+  xSemaphoreGive(serialBufferMutex);
+  return pending;
+}
+
+// Send a heap buffer as the response body; the buffer lives until the last chunk is out
+void sendSerialBody(AsyncWebServerRequest *request, const char *type, std::shared_ptr<char> body, size_t length)
+{
+  request->send(request->beginResponse(type, length,
+      [body, length](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+      {
+        size_t n = min(maxLen, length - index);
+        memcpy(buffer, body.get() + index, n);
+        return n;
+      }));
 }
 
 // Updated setupWebServer() function - add these endpoints to your existing setup
 void setupEnhancedSerialEndpoints()
 {
   // Enhanced serial output endpoint
-  server.on("/api/serial", HTTP_GET, []()
-            {
-    DynamicJsonDocument doc(4096);
-    doc["output"] = getSerialBuffer();
-    doc["totalMessages"] = totalMessages;
-    doc["bufferSize"] = SERIAL_BUFFER_SIZE;
-    
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response); });
+  server.on("/api/serial", HTTP_GET, handleSerial);
+  server.on("/api/serial/text", HTTP_GET, handleSerialText);
 
   // Add API endpoint to clear serial buffer
-  server.on("/api/serial/clear", HTTP_POST, []()
+  server.on("/api/serial/clear", HTTP_POST, [](AsyncWebServerRequest *request)
             {
     clearSerialBuffer();
     logSerial("Serial buffer cleared via web interface");
-    server.send(200, "application/json", "{\"status\":\"success\"}"); });
+    request->send(200, "application/json", "{\"status\":\"success\"}"); });
 }
 
 // Function to clear serial buffer
 void clearSerialBuffer()
 {
+  xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
   serialBufferIndex = 0;
   totalMessages = 0;
   memset(serialBuffer, 0, sizeof(serialBuffer));
+  xSemaphoreGive(serialBufferMutex);
 }
 
 // Alternative logSerial function that matches GPS tracker style exactly
 void serialPrintln(const char *message)
 {
-  DateTime now;
-  String timestampStr;
-
-  if (rtcAvailable)
-  {
-    now = rtc.now();
-    timestampStr = formatTime(now);
-  }
-  else
-  {
-    timestampStr = "??:??:??";
-  }
-
-  // Create timestamped message
-  String logMessage = "[" + timestampStr + "] " + String(message);
-
-  // Print to Serial
-  Serial.println(logMessage);
-
-  // Store in buffer with exact GPS tracker logic
-  strncpy(serialBuffer[serialBufferIndex].message, logMessage.c_str(), sizeof(serialBuffer[0].message) - 1);
-  serialBuffer[serialBufferIndex].message[sizeof(serialBuffer[0].message) - 1] = '\0';
-  serialBuffer[serialBufferIndex].timestamp = millis();
-
-  serialBufferIndex = (serialBufferIndex + 1) % SERIAL_BUFFER_SIZE;
-  if (totalMessages < SERIAL_BUFFER_SIZE)
-    totalMessages++;
+  logSerial("%s", message);
 }
 
 // Enhanced web handler for serial with text response (GPS tracker style)
-void handleSerialText()
+void handleSerialText(AsyncWebServerRequest *request)
 {
-  String logs;
-  logs.reserve(SERIAL_BUFFER_SIZE * 100); // Pre-allocate space
+  uint32_t since = request->hasParam("since") ? strtoul(request->getParam("since")->value().c_str(), NULL, 10) : 0;
+  bool resumed;
+  size_t capacity = pendingSerialLines(since, resumed) * SERIAL_LINE_MAX + 1;
 
-  int start = (serialBufferIndex - totalMessages + SERIAL_BUFFER_SIZE) % SERIAL_BUFFER_SIZE;
-  for (int i = 0; i < totalMessages; i++)
+  // One allocation sized for the new lines only
+  std::shared_ptr<char> body(new (std::nothrow) char[capacity], std::default_delete<char[]>());
+  if (!body)
   {
-    int index = (start + i) % SERIAL_BUFFER_SIZE;
-    logs += String(serialBuffer[index].timestamp);
-    logs += ": ";
-    logs += serialBuffer[index].message;
-    logs += "\n";
+    request->send(503, "text/plain", "Out of memory");
+    return;
   }
 
-  server.send(200, "text/plain", logs);
+  size_t length = copySerialLines(since, body.get(), capacity, false, true);
+  sendSerialBody(request, "text/plain", body, length);
 }
 
 // Enhanced format time function with better precision
@@ -282,21 +1267,33 @@ void setup()
 {
   Serial.begin(115200);
 
-  // Initialize pins
-  pinMode(FILL_SOLENOID_PIN, OUTPUT);
-  pinMode(EMPTY_SOLENOID_PIN, OUTPUT);
+  // Inter-task plumbing must exist before the first log line or web request
+  serialBufferMutex = xSemaphoreCreateMutex();
+  startSerialTask();
+  i2c1Mutex = xSemaphoreCreateMutex();
+  i2c2Mutex = xSemaphoreCreateMutex();
+  logStoreMutex = xSemaphoreCreateMutex();
+  controlTaskHandle = xTaskGetCurrentTaskHandle(); // setup() and loop() share the task
+
+  // Initialize pins; every channel's solenoids start closed (active LOW)
+  for (int ch = 0; ch < PROBE_CHANNELS; ch++)
+  {
+    pinMode(probeHardware[ch].fillPin, OUTPUT);
+    pinMode(probeHardware[ch].emptyPin, OUTPUT);
+    digitalWrite(probeHardware[ch].fillPin, HIGH);
+    digitalWrite(probeHardware[ch].emptyPin, HIGH);
+  }
   pinMode(MEASURING_RELAY_PIN, OUTPUT);
 
-  // Ensure solenoids are closed and measuring light shows red (relay OFF = NC = Red light)
-  digitalWrite(FILL_SOLENOID_PIN, HIGH);
-  digitalWrite(EMPTY_SOLENOID_PIN, HIGH);
+  // Measuring light shows red (relay OFF = NC = Red light)
   digitalWrite(MEASURING_RELAY_PIN, HIGH); // LOW = Red light (NC), HIGH = Green light (NO)
+  initValveTimers();
 
   // Initialize I2C buses with custom pins
   I2C_1.begin(SDA_PIN, SCL_PIN);   // Primary I2C bus
   I2C_2.begin(SDA2_PIN, SCL2_PIN); // Secondary I2C bus
-  I2C_1.setClock(100000);          // Set I2C clock to 100kHz for stability
-  I2C_2.setClock(100000);          // Set I2C clock to 100kHz for stability
+  I2C_1.setClock(I2C_CLOCK_HZ);    // Steps down on errors, see recordI2cResult()
+  I2C_2.setClock(I2C_CLOCK_HZ);
 
   // Initialize system first (this will initialize RTC)
   initializeSystem();
@@ -307,99 +1304,382 @@ void setup()
   // Setup WiFi hotspot
   setupWiFiHotspot();
 
-  // Setup web server
+  // Setup web server (handlers run on the async_tcp task, see CONFIG_ASYNC_TCP_RUNNING_CORE)
+  publishStatus();
   setupWebServer();
 
+  // Screens render from the status snapshot on their own task
+  startDisplayTask();
+  startCaptureTask();
+  startUploadTask();
+
   logSerial("Claybath density measurement system initialized");
 }
 
-// Enhanced web handler for serial data with JSON response
-void handleSerial()
+// Enhanced web handler for serial data with JSON response. With ?since=<seq>
+// only lines after the client's cursor are returned; "seq" is the next cursor
+// and "reset" tells the client its cursor was lost and output starts over.
+void handleSerial(AsyncWebServerRequest *request)
 {
-  DynamicJsonDocument doc(4096);
-  doc["output"] = getSerialBuffer();
-  doc["totalMessages"] = totalMessages;
-  doc["bufferSize"] = SERIAL_BUFFER_SIZE;
+  uint32_t since = request->hasParam("since") ? strtoul(request->getParam("since")->value().c_str(), NULL, 10) : 0;
+  bool resumed;
+  size_t capacity = SERIAL_JSON_OVERHEAD + pendingSerialLines(since, resumed) * SERIAL_LINE_MAX;
+
+  std::shared_ptr<char> body(new (std::nothrow) char[capacity], std::default_delete<char[]>());
+  if (!body)
+  {
+    request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+    return;
+  }
 
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response);
+  // The lines are escaped straight into the body, no document or String in between
+  char *out = body.get();
+  size_t length = snprintf(out, capacity, "{\"output\":\"");
+  length += copySerialLines(since, out + length, capacity - SERIAL_JSON_OVERHEAD, true, false);
+  length += snprintf(out + length, capacity - length,
+                     "\",\"totalMessages\":%d,\"bufferSize\":%d,\"seq\":%u,\"reset\":%s}",
+                     totalMessages, SERIAL_BUFFER_SIZE, (unsigned)since, resumed ? "false" : "true");
+  sendSerialBody(request, "application/json", body, length);
 }
 
 void loop()
 {
-  server.handleClient();
-  updateMeasurementState();
-
-  // Check for automatic measurement - NEW: Check if auto-measurement is enabled
-  if (measurementState == IDLE && !isManualMode &&
-      config.autoMeasurementEnabled && // NEW: Only trigger if enabled
-      nextMeasurementTime.unixtime() > 0 &&
-      rtc.now().unixtime() >= nextMeasurementTime.unixtime())
-  {
-    logSerial("Automatic measurement triggered");
-    performMeasurement();
-  }
+  int64_t loopStart = esp_timer_get_time();
+  serviceClock();
+  int64_t mark = recordStage(METRIC_CLOCK, loopStart);
+  serviceStateStore();
+  mark = recordStage(METRIC_STATE_STORE, mark);
+  processControlCommands();
+  mark = recordStage(METRIC_COMMANDS, mark);
+  uint32_t waitMs = stepChannels();
+  mark = recordStage(METRIC_MEASUREMENT, mark);
 
-  updateDisplays();
   controlRelays();
-  delay(10);
+  mark = recordStage(METRIC_RELAYS, mark);
+  publishStatus();
+  updatePowerMode();
+  mark = recordStage(METRIC_PUBLISH, mark);
+  recordMetric(METRIC_LOOP, mark - loopStart);
+
+  // Sleep until the next deadline, or until a web command is published
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(waitMs));
+  recordStage(METRIC_WAIT, mark);
 }
 
-void initializeSystem()
+// Run every fitted channel's state machine and schedule in turn. Returns how
+// long the loop may sleep before any of them has work.
+uint32_t stepChannels()
 {
-  // Initialize LittleFS
-  if (!LittleFS.begin())
-  {
-    logSerial("LittleFS initialization failed!");
-    return;
-  }
-
-  // Load configuration
-  loadConfig();
+  uint32_t waitMs = CONTROL_IDLE_MAX_WAIT_MS;
 
-  // Initialize DS3231 RTC on I2C Bus 2
-  if (!rtc.begin(&I2C_2))
+  // Samples belong to the lease holder; with the lease free (idle between
+  // cycles included) nobody needs them, so keep the ring from overrunning
+  if (sensorOwner < 0)
   {
-    logSerial("Couldn't find DS3231 RTC on I2C Bus 2");
-    rtcAvailable = false;
+    discardSamples();
   }
-  else
-  {
-    rtcAvailable = true;
-    logSerial("DS3231 RTC initialized successfully on I2C Bus 2");
 
-    // Check if RTC lost power and if so, set the time
-    if (rtc.lostPower())
+  for (int channel = 0; channel < PROBE_CHANNELS; channel++)
+  {
+    if (!channelPresent[channel])
     {
-      logSerial("RTC lost power, setting time to compile time");
-      // Set to compile time as fallback
-      rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+      continue;
     }
-
-    // Print current time
-    DateTime now = rtc.now();
-    logSerial("Current time: " + String(now.year()) + "/" +
-              String(now.month()) + "/" + String(now.day()) + " " +
-              String(now.hour()) + ":" + String(now.minute()) + ":" + String(now.second()));
-  }
-
-  // Initialize MPU6050 on I2C Bus 1
-  if (!mpu.begin(MPU6050_ADDRESS, &I2C_1))
-  {
-    logSerial("Failed to find MPU6050 chip on I2C Bus 1");
-    while (1)
+    selectChannel(channel);
+    updateMeasurementState();
+
+    // Check for automatic measurement - NEW: Check if auto-measurement is enabled
+    if (measurementState == IDLE && !isManualMode &&
+        config.autoMeasurementEnabled && // NEW: Only trigger if enabled
+        nextMeasurementTime.unixtime() > 0 &&
+        nowUnix() >= nextMeasurementTime.unixtime())
     {
-      delay(10);
+      logSerial("Automatic measurement triggered");
+      performMeasurement(config.seriesReplicates);
     }
+
+    releaseSensor();
+    waitMs = min(waitMs, controlWaitMs());
   }
-  logSerial("MPU6050 initialized successfully on I2C Bus 1");
+  selectChannel(0);
+  return waitMs;
+}
 
-  // Configure MPU6050
-  mpu.setAccelerometerRange(MPU6050_RANGE_8_G);
+// Exchange the globals with a channel's saved context
+void swapChannelContext(int channel)
+{
+  ChannelContext &context = channelContexts[channel];
+  std::swap(config, context.config);
+  std::swap(calibrationLut, context.calibrationLut);
+  std::swap(fillValve, context.fillValve);
+  std::swap(emptyValve, context.emptyValve);
+  std::swap(measurementState, context.measurementState);
+  std::swap(stateStartTime, context.stateStartTime);
+  std::swap(reading, context.reading);
+  std::swap(settleWindow, context.settleWindow);
+  std::swap(settleWindowStart, context.settleWindowStart);
+  std::swap(settlePreviousMean, context.settlePreviousMean);
+  std::swap(settleStableSeconds, context.settleStableSeconds);
+  std::swap(measurementFlags, context.measurementFlags);
+  std::swap(lastAngleReadTime, context.lastAngleReadTime);
+  std::swap(seriesTarget, context.seriesTarget);
+  std::swap(seriesIndex, context.seriesIndex);
+  std::swap(seriesCount, context.seriesCount);
+  std::swap(seriesDensityMean, context.seriesDensityMean);
+  std::swap(seriesAngleMean, context.seriesAngleMean);
+  std::swap(seriesAngleM2, context.seriesAngleM2);
+  std::swap(seriesSamples, context.seriesSamples);
+  std::swap(seriesFlags, context.seriesFlags);
+  std::swap(currentAngle, context.currentAngle);
+  std::swap(liveAngle, context.liveAngle);
+  std::swap(currentDensity, context.currentDensity);
+  std::swap(lastMeasurement, context.lastMeasurement);
+  std::swap(lastMeasurementStdDev, context.lastMeasurementStdDev);
+  std::swap(lastMeasurementSamples, context.lastMeasurementSamples);
+  std::swap(lastMeasurementTime, context.lastMeasurementTime);
+  std::swap(nextMeasurementTime, context.nextMeasurementTime);
+  std::swap(isMeasuring, context.isMeasuring);
+}
+
+// Make 'channel' the one the globals describe (control loop only). Channel 0
+// is the resting state: select it again when done with another channel. The
+// sampling fields are kept equal across channels and reach the sensor task
+// through channelAcquisition[].
+void selectChannel(int channel)
+{
+  if (channel == activeChannel)
+  {
+    return;
+  }
+  if (activeChannel != 0)
+  {
+    swapChannelContext(activeChannel); // Channel 0 back in place
+  }
+  if (channel != 0)
+  {
+    swapChannelContext(channel);
+  }
+  activeChannel = channel;
+}
+
+// Sampling lease: one channel at a time settles and measures, the sensor task
+// follows its probe. A channel whose chamber is full waits in FILLING or
+// EXCHANGING until the lease is free, so one tank fills or drains while
+// another is sampled.
+bool claimSensor()
+{
+  if (sensorOwner >= 0 && sensorOwner != activeChannel)
+  {
+    return false;
+  }
+  sensorOwner = activeChannel;
+  if (requestedProbe.load() != activeChannel)
+  {
+    requestedProbe = activeChannel;
+    sensorSwitching = true;
+    acquisitionReconfigure = true;
+    logSerial("Sampling switched to probe %d", activeChannel);
+  }
+  return true;
+}
+
+// Give the lease back once the selected channel is done sampling
+void releaseSensor()
+{
+  if (sensorOwner == activeChannel && measurementState != WAITING_TO_SETTLE && measurementState != MEASURING)
+  {
+    sensorOwner = -1;
+  }
+}
+
+// Some channel runs a cycle (channel 0 selected)
+bool anyChannelMeasuring()
+{
+  bool measuring = isMeasuring;
+  for (int channel = 1; channel < PROBE_CHANNELS; channel++)
+  {
+    measuring = measuring || channelContexts[channel].isMeasuring;
+  }
+  return measuring;
+}
+
+// Boot: contexts of the channels after the first. Each starts from channel 0's
+// settings until it has a settings file of its own; sampling settings always
+// follow channel 0.
+void initChannels()
+{
+  const Config first = config;
+  for (int channel = 1; channel < PROBE_CHANNELS; channel++)
+  {
+    ChannelContext &context = channelContexts[channel];
+    context.config = first;
+    context.config.lastMeasurementValue = 0.0;
+    context.config.lastMeasurementTime = 0;
+    context.config.lastMeasurementAngle = 0.0;
+    context.calibrationLut = channelLuts[channel];
+    context.fillValve = &channelValves[channel][0];
+    context.emptyValve = &channelValves[channel][1];
+    context.measurementState = IDLE;
+    context.settlePreviousMean = NAN;
+    context.seriesTarget = 1;
+
+    selectChannel(channel);
+    if (loadSettingsBlob())
+    {
+      logSerial("Configuration loaded from settings_ch%d.bin", channel);
+    }
+    config.sampleRateHz = first.sampleRateHz;
+    config.acquisitionMode = first.acquisitionMode;
+    buildCalibrationLut();
+    restoreLastMeasurement();
+  }
+  selectChannel(0);
+
+  for (int channel = 0; channel < PROBE_CHANNELS; channel++)
+  {
+    publishAcquisition(channel, first);
+  }
+}
+
+// Time until the control loop next has work: the end of a timed phase, the
+// next scheduled measurement, or the sample-draining interval while measuring
+uint32_t controlWaitMs()
+{
+  unsigned long elapsed = millis() - stateStartTime;
+  unsigned long duration;
+
+  switch (measurementState)
+  {
+  case WAITING_TO_SETTLE:
+  case MEASURING:
+    return CONTROL_ACTIVE_INTERVAL_MS;
+  case EMPTYING_INITIAL:
+    duration = 1000;
+    break;
+  case FILLING:
+    duration = config.fillDurationMs;
+    break;
+  case EMPTYING_FINAL:
+    duration = config.emptyDurationMs;
+    break;
+  case EXCHANGING:
+    duration = config.seriesFlushMs + config.fillDurationMs;
+    break;
+  default:
+  {
+    // Idle: wake for the next automatic measurement
+    uint32_t next = nextMeasurementTime.unixtime();
+    if (!isManualMode && config.autoMeasurementEnabled && next > 0)
+    {
+      uint32_t now = nowUnix();
+      return next <= now ? 0 : min((uint32_t)CONTROL_IDLE_MAX_WAIT_MS, (next - now) * 1000);
+    }
+    return CONTROL_IDLE_MAX_WAIT_MS;
+  }
+  }
+
+  if (elapsed < duration)
+  {
+    return min((unsigned long)CONTROL_BUSY_MAX_WAIT_MS, duration - elapsed);
+  }
+  // Chamber full but another channel holds the sampling lease; its own
+  // CONTROL_ACTIVE_INTERVAL_MS keeps the loop polling meanwhile
+  bool waitingForSensor = (measurementState == FILLING || measurementState == EXCHANGING) &&
+                          sensorOwner >= 0 && sensorOwner != activeChannel;
+  return waitingForSensor ? CONTROL_BUSY_MAX_WAIT_MS : 0;
+}
+
+// Drop the CPU clock between cycles when nobody is connected to the AP
+void updatePowerMode()
+{
+  bool idle = !anyChannelMeasuring() && WiFi.softAPgetStationNum() == 0;
+  uint32_t target = idle ? CPU_FREQ_IDLE_MHZ : CPU_FREQ_ACTIVE_MHZ;
+  if (target != cpuFrequencyMhz)
+  {
+    setCpuFrequencyMhz(target);
+    cpuFrequencyMhz = target;
+    logSerial("CPU clock set to %u MHz", (unsigned)target);
+  }
+}
+
+void initializeSystem()
+{
+  // Initialize LittleFS
+  if (!LittleFS.begin())
+  {
+    logSerial("LittleFS initialization failed!");
+    return;
+  }
+
+  // Load configuration
+  loadConfig();
+  buildCalibrationLut();
+  loadNetworkConfig();
+
+  // Open the binary measurement log
+  initMeasurementLog();
+
+  // The only full directory walk; later listings and deletes use the catalog
+  buildFileCatalog();
+
+  // Last result from NVS, or from the log if NVS missed the latest commit
+  restoreLastMeasurement();
+  initChannels();
+  loadBatches();
+  rebuildRollups();
+
+  // Initialize DS3231 RTC on I2C Bus 2
+  if (!rtc.begin(&I2C_2))
+  {
+    logSerial("Couldn't find DS3231 RTC on I2C Bus 2");
+    rtcAvailable = false;
+  }
+  else
+  {
+    rtcAvailable = true;
+    logSerial("DS3231 RTC initialized successfully on I2C Bus 2");
+
+    // Check if RTC lost power and if so, set the time
+    if (rtc.lostPower())
+    {
+      logSerial("RTC lost power, setting time to compile time");
+      // Set to compile time as fallback
+      rtc.adjust(DateTime(F(__DATE__), F(__TIME__)));
+    }
+
+    // Print current time
+    syncClock();
+    DateTime now = nowDateTime();
+    logSerial("Current time: %d/%d/%d %d:%02d:%02d",
+              now.year(), now.month(), now.day(), now.hour(), now.minute(), now.second());
+  }
+
+  // Initialize MPU6050 on I2C Bus 1
+  if (!mpu.begin(MPU6050_ADDRESS, &I2C_1))
+  {
+    logSerial("Failed to find MPU6050 chip on I2C Bus 1");
+    while (1)
+    {
+      delay(10);
+    }
+  }
+  logSerial("MPU6050 initialized successfully on I2C Bus 1");
+
+  // Configure MPU6050
+  mpu.setAccelerometerRange(MPU_ACCEL_RANGE);
   mpu.setGyroRange(MPU6050_RANGE_500_DEG);
   mpu.setFilterBandwidth(MPU6050_BAND_21_HZ);
 
+  // Probes of further channels are optional; a channel without one stays off
+  for (int channel = 1; channel < PROBE_CHANNELS; channel++)
+  {
+    channelPresent[channel] = initProbe(probeHardware[channel].mpuAddress);
+    if (channelPresent[channel])
+      logSerial("Probe %d MPU6050 initialized at 0x%02X", channel, probeHardware[channel].mpuAddress);
+    else
+      logSerial("No MPU6050 for probe %d at 0x%02X, channel disabled", channel, probeHardware[channel].mpuAddress);
+  }
+
   // Allow sensor to stabilize
   delay(100);
 
@@ -432,12 +1712,20 @@ void initializeSystem()
   display1.setTextColor(SSD1306_WHITE);
   display2.setTextSize(1);
   display2.setTextColor(SSD1306_WHITE);
-  ;
+
+  // Start high-rate sampling on its own task. The display init above uses
+  // I2C_1 (and sets its clock) without i2c1Lock(), so it runs first.
+  startSensorTask();
 
   delay(2000);
 
   // Calculate next measurement time based on last measurement
-  calculateNextMeasurementTime();
+  for (int channel = 0; channel < PROBE_CHANNELS; channel++)
+  {
+    selectChannel(channel);
+    calculateNextMeasurementTime();
+  }
+  selectChannel(0);
 
   logSerial("System initialization complete");
 }
@@ -452,7 +1740,7 @@ void calculateNextMeasurementTime()
     return;
   }
 
-  DateTime now = rtc.now();
+  DateTime now = nowDateTime();
 
   // Check if we have a valid last measurement time
   if (config.lastMeasurementTime > 0)
@@ -476,9 +1764,9 @@ void calculateNextMeasurementTime()
       }
       else
       {
-        logSerial("Next measurement scheduled for: " + formatTime(nextMeasurementTime) +
-                  " on " + String(nextMeasurementTime.day()) + "/" +
-                  String(nextMeasurementTime.month()) + "/" + String(nextMeasurementTime.year()));
+        logSerial("Next measurement scheduled for: %02d:%02d:%02d on %d/%d/%d",
+                  nextMeasurementTime.hour(), nextMeasurementTime.minute(), nextMeasurementTime.second(),
+                  nextMeasurementTime.day(), nextMeasurementTime.month(), nextMeasurementTime.year());
       }
     }
     else
@@ -499,115 +1787,297 @@ void calculateNextMeasurementTime()
 
 void loadConfig()
 {
-  if (LittleFS.exists("/settings.json"))
+  if (loadSettingsBlob())
   {
-    File file = LittleFS.open("/settings.json", "r");
-    if (file)
-    {
-      DynamicJsonDocument doc(1024);
-      DeserializationError error = deserializeJson(doc, file);
+    logSerial("Configuration loaded from settings.bin");
+  }
+  else if (loadLegacyConfig())
+  {
+    // One-time migration from the old JSON file
+    saveConfig();
+    LittleFS.remove(LEGACY_SETTINGS_FILE);
+    logSerial("Configuration migrated from settings.json");
+  }
+  else
+  {
+    logSerial("No valid settings found, creating default configuration");
+    createDefaultConfig();
+  }
 
-      if (error)
-      {
-        logSerial("Failed to parse settings.json, creating new one");
-        file.close();
-        createDefaultConfig();
-        return;
-      }
+  // Log auto-measurement status
+  logSerial("Automatic measurements: %s", config.autoMeasurementEnabled ? "ENABLED" : "DISABLED");
+}
 
-      config.desiredDensity = doc["desiredDensity"] | 1.025;
-      config.measurementInterval = doc["measurementInterval"] | 30;
-      config.fillDuration = doc["fillDuration"] | 5;
-      config.waitDuration = doc["waitDuration"] | 60;
-      config.measurementDuration = doc["measurementDuration"] | 10;
-      config.emptyDuration = doc["emptyDuration"] | 120;
-      config.calibrationOffset = doc["calibrationOffset"] | 0.0;
-      config.calibrationScale = doc["calibrationScale"] | 1.0;
-      config.lastMeasurementValue = doc["lastMeasurementValue"] | 0.0;
-      config.lastMeasurementTime = doc["lastMeasurementTime"] | 0;
-      config.targetAngleMin = doc["targetAngleMin"] | 40.0;
-      config.targetAngleMax = doc["targetAngleMax"] | 45.0;
-      config.lastMeasurementAngle = doc["lastMeasurementAngle"] | 0.0;
-      config.autoMeasurementEnabled = doc["autoMeasurementEnabled"] | false; // NEW
+void packSettings(const Config &source, SettingsPayload &payload)
+{
+  payload.desiredDensity = source.desiredDensity;
+  payload.measurementInterval = source.measurementInterval;
+  payload.fillDuration = min((source.fillDurationMs + 999) / 1000, (uint32_t)UINT16_MAX);
+  payload.waitDuration = source.waitDuration;
+  payload.measurementDuration = source.measurementDuration;
+  payload.emptyDuration = min((source.emptyDurationMs + 999) / 1000, (uint32_t)UINT16_MAX);
+  payload.sampleRateHz = source.sampleRateHz;
+  payload.acquisitionMode = source.acquisitionMode;
+  payload.autoMeasurementEnabled = source.autoMeasurementEnabled;
+  payload.settleStableSeconds = source.settleStableSeconds;
+  payload.convergenceThreshold = source.convergenceThreshold;
+  payload.settleThreshold = source.settleThreshold;
+  payload.calibrationOffset = source.calibrationOffset;
+  payload.calibrationScale = source.calibrationScale;
+  payload.targetAngleMin = source.targetAngleMin;
+  payload.targetAngleMax = source.targetAngleMax;
+  payload.calibrationPointCount = source.calibrationPointCount;
+  memcpy(payload.calibrationAngles, source.calibrationAngles, sizeof(payload.calibrationAngles));
+  memcpy(payload.calibrationDensities, source.calibrationDensities, sizeof(payload.calibrationDensities));
+  payload.fillDurationMs = source.fillDurationMs;
+  payload.emptyDurationMs = source.emptyDurationMs;
+  payload.seriesReplicates = source.seriesReplicates;
+  payload.seriesFlushMs = source.seriesFlushMs;
+}
 
-      file.close();
-      logSerial("Configuration loaded from settings.json");
+void unpackSettings(const SettingsPayload &payload, Config &target)
+{
+  target.desiredDensity = payload.desiredDensity;
+  target.measurementInterval = payload.measurementInterval;
+  target.fillDurationMs = payload.fillDurationMs;
+  target.waitDuration = payload.waitDuration;
+  target.measurementDuration = payload.measurementDuration;
+  target.emptyDurationMs = payload.emptyDurationMs;
+  target.sampleRateHz = achievableSampleRate(payload.sampleRateHz);
+  target.acquisitionMode = payload.acquisitionMode;
+  target.autoMeasurementEnabled = payload.autoMeasurementEnabled;
+  target.settleStableSeconds = payload.settleStableSeconds;
+  target.convergenceThreshold = payload.convergenceThreshold;
+  target.settleThreshold = payload.settleThreshold;
+  target.calibrationOffset = payload.calibrationOffset;
+  target.calibrationScale = payload.calibrationScale;
+  target.targetAngleMin = payload.targetAngleMin;
+  target.targetAngleMax = payload.targetAngleMax;
+  target.calibrationPointCount = min((int)payload.calibrationPointCount, CAL_MAX_POINTS);
+  memcpy(target.calibrationAngles, payload.calibrationAngles, sizeof(payload.calibrationAngles));
+  memcpy(target.calibrationDensities, payload.calibrationDensities, sizeof(payload.calibrationDensities));
+  target.seriesReplicates = constrain((int)payload.seriesReplicates, 1, SERIES_MAX_REPLICATES);
+  target.seriesFlushMs = payload.seriesFlushMs;
+}
 
-      if (config.lastMeasurementTime > 0)
-      {
-        lastMeasurement = config.lastMeasurementValue;
-        currentAngle = config.lastMeasurementAngle;
-        lastMeasurementTime = DateTime(config.lastMeasurementTime);
-        logSerial("Last measurement restored: " + String(lastMeasurement, 3) +
-                  " (angle: " + String(config.lastMeasurementAngle, 1) + "°) at " +
-                  String(lastMeasurementTime.timestamp()));
-      }
+// Settings file of the selected channel
+const char *settingsPath(char *buffer, size_t length)
+{
+  if (activeChannel == 0)
+  {
+    return SETTINGS_FILE;
+  }
+  snprintf(buffer, length, CHANNEL_SETTINGS_FILE, activeChannel);
+  return buffer;
+}
 
-      // Log auto-measurement status
-      logSerial("Automatic measurements: " + String(config.autoMeasurementEnabled ? "ENABLED" : "DISABLED"));
-    }
-    else
-    {
-      logSerial("Failed to open settings.json, creating new one");
-      createDefaultConfig();
-    }
+// Read and verify /settings.bin (the selected channel's). Returns false
+// (config untouched) on any mismatch.
+bool loadSettingsBlob()
+{
+  char pathBuffer[CATALOG_NAME_MAX];
+  File file = LittleFS.open(settingsPath(pathBuffer, sizeof(pathBuffer)), "r");
+  if (!file)
+  {
+    return false;
   }
-  else
+
+  SettingsHeader header;
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+      header.magic != SETTINGS_MAGIC || header.version > SETTINGS_VERSION)
   {
-    logSerial("settings.json not found, creating default configuration");
-    createDefaultConfig();
+    file.close();
+    return false;
+  }
+
+  // Start from the current values so fields missing from an older payload keep their defaults
+  SettingsPayload payload;
+  packSettings(config, payload);
+  size_t known = min((size_t)header.size, sizeof(payload));
+  bool ok = file.read((uint8_t *)&payload, known) == known;
+  uint32_t crc = crc32_le(0, (const uint8_t *)&payload, known);
+  file.close();
+
+  if (!ok || crc != header.crc)
+  {
+    logSerial("settings.bin failed the integrity check");
+    return false;
+  }
+
+  // Blobs from before millisecond durations only carry whole seconds
+  if (known < offsetof(SettingsPayload, emptyDurationMs) + sizeof(payload.emptyDurationMs))
+  {
+    payload.fillDurationMs = payload.fillDuration * 1000UL;
+    payload.emptyDurationMs = payload.emptyDuration * 1000UL;
+  }
+
+  unpackSettings(payload, config);
+  repairConfigFields(config); // Older firmware stored whatever it was given
+  return true;
+}
+
+// Pre-binary settings.json, read once for migration
+bool loadLegacyConfig()
+{
+  File file = LittleFS.open(LEGACY_SETTINGS_FILE, "r");
+  if (!file)
+  {
+    return false;
+  }
+
+  DynamicJsonDocument doc(1024);
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+
+  if (error)
+  {
+    logSerial("Failed to parse settings.json");
+    return false;
   }
+
+  config.desiredDensity = doc["desiredDensity"] | 1.025;
+  config.measurementInterval = doc["measurementInterval"] | 30;
+  config.fillDurationMs = (doc["fillDuration"] | 5) * 1000UL;
+  config.waitDuration = doc["waitDuration"] | 60;
+  config.measurementDuration = doc["measurementDuration"] | 10;
+  config.emptyDurationMs = (doc["emptyDuration"] | 120) * 1000UL;
+  config.sampleRateHz = achievableSampleRate(doc["sampleRateHz"] | 200);
+  config.acquisitionMode = doc["acquisitionMode"] | ACQ_FIFO;
+  config.convergenceThreshold = doc["convergenceThreshold"] | 0.02;
+  config.settleStableSeconds = doc["settleStableSeconds"] | 5;
+  config.settleThreshold = doc["settleThreshold"] | 0.05;
+  config.calibrationOffset = doc["calibrationOffset"] | 0.0;
+  config.calibrationScale = doc["calibrationScale"] | 1.0;
+  config.lastMeasurementValue = doc["lastMeasurementValue"] | 0.0;
+  config.lastMeasurementTime = doc["lastMeasurementTime"] | 0;
+  config.targetAngleMin = doc["targetAngleMin"] | 40.0;
+  config.targetAngleMax = doc["targetAngleMax"] | 45.0;
+  config.lastMeasurementAngle = doc["lastMeasurementAngle"] | 0.0;
+  config.autoMeasurementEnabled = doc["autoMeasurementEnabled"] | false; // NEW
+  repairConfigFields(config);
+  return true;
 }
 
 void createDefaultConfig()
 {
   config.desiredDensity = 1.025;
   config.measurementInterval = 30;
-  config.fillDuration = 5;
+  config.fillDurationMs = 5000;
   config.waitDuration = 5;
   config.measurementDuration = 10;
-  config.emptyDuration = 5;
+  config.emptyDurationMs = 5000;
+  config.sampleRateHz = 200;
+  config.acquisitionMode = ACQ_FIFO;
+  config.convergenceThreshold = 0.02;
+  config.settleStableSeconds = 5;
+  config.settleThreshold = 0.05;
   config.calibrationOffset = 0.0;
   config.calibrationScale = 1.0;
+  config.calibrationPointCount = 0;
   config.lastMeasurementValue = 0.0;
   config.lastMeasurementTime = 0;
   config.targetAngleMin = 40.0;
   config.targetAngleMax = 45.0;
   config.lastMeasurementAngle = 0.0;
   config.autoMeasurementEnabled = false; // NEW: Default to disabled
+  config.seriesReplicates = 1;
+  config.seriesFlushMs = 30000;
 
   saveConfig();
   logSerial("Default configuration created and saved");
 }
 
+// Write the settings blob; only called when settings change, not per measurement
 void saveConfig()
 {
-  DynamicJsonDocument doc(1024);
-  doc["desiredDensity"] = config.desiredDensity;
-  doc["measurementInterval"] = config.measurementInterval;
-  doc["fillDuration"] = config.fillDuration;
-  doc["waitDuration"] = config.waitDuration;
-  doc["measurementDuration"] = config.measurementDuration;
-  doc["emptyDuration"] = config.emptyDuration;
-  doc["calibrationOffset"] = config.calibrationOffset;
-  doc["calibrationScale"] = config.calibrationScale;
-  doc["lastMeasurementValue"] = config.lastMeasurementValue;
-  doc["lastMeasurementTime"] = config.lastMeasurementTime;
-  doc["targetAngleMin"] = config.targetAngleMin;
-  doc["targetAngleMax"] = config.targetAngleMax;
-  doc["lastMeasurementAngle"] = config.lastMeasurementAngle;
-  doc["autoMeasurementEnabled"] = config.autoMeasurementEnabled; // NEW
-
-  File file = LittleFS.open("/settings.json", "w");
+  SettingsHeader header;
+  SettingsPayload payload;
+  packSettings(config, payload);
+  header.magic = SETTINGS_MAGIC;
+  header.version = SETTINGS_VERSION;
+  header.size = sizeof(payload);
+  header.crc = crc32_le(0, (const uint8_t *)&payload, sizeof(payload));
+
+  // Write a temp file and rename it, so a reset mid-write keeps the old settings
+  char pathBuffer[CATALOG_NAME_MAX];
+  const char *path = settingsPath(pathBuffer, sizeof(pathBuffer));
+  File file = LittleFS.open(SETTINGS_TEMP_FILE, "w");
   if (file)
   {
-    serializeJson(doc, file);
+    bool ok = file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+              file.write((const uint8_t *)&payload, sizeof(payload)) == sizeof(payload);
     file.close();
-    logSerial("Configuration saved to settings.json");
+    if (ok && LittleFS.rename(SETTINGS_TEMP_FILE, path))
+    {
+      catalogUpdate(path, sizeof(header) + sizeof(payload));
+      logSerial("Configuration saved to settings.bin");
+      return;
+    }
   }
-  else
+  logSerial("Failed to save configuration to settings.bin");
+}
+
+// Pick the newest of NVS, the migrated settings and the measurement log.
+// Only channel 0 keeps its result in NVS, the others restore from the log.
+void restoreLastMeasurement()
+{
+  LastMeasurementState state;
+  if (activeChannel == 0 && statePrefs.begin(STATE_NVS_NAMESPACE, false) &&
+      statePrefs.getBytes("last", &state, sizeof(state)) == sizeof(state) &&
+      state.time > config.lastMeasurementTime)
+  {
+    config.lastMeasurementTime = state.time;
+    config.lastMeasurementValue = state.density;
+    config.lastMeasurementAngle = state.angle;
+  }
+
+  // Every result is logged right away, so the log covers a commit lost to a power cut
+  LogRecord record;
+  if (readNewestLogRecord(record, activeChannel) && record.timestamp > config.lastMeasurementTime)
+  {
+    config.lastMeasurementTime = record.timestamp;
+    config.lastMeasurementValue = record.density;
+    config.lastMeasurementAngle = record.angle;
+    markMeasurementStateDirty();
+  }
+
+  if (config.lastMeasurementTime > 0)
+  {
+    lastMeasurement = config.lastMeasurementValue;
+    currentAngle = config.lastMeasurementAngle;
+    lastMeasurementTime = DateTime(config.lastMeasurementTime);
+    logSerial("Last measurement restored: %.3f (angle: %.1f°) at %04d-%02d-%02dT%02d:%02d:%02d",
+              lastMeasurement, config.lastMeasurementAngle, lastMeasurementTime.year(), lastMeasurementTime.month(),
+              lastMeasurementTime.day(), lastMeasurementTime.hour(), lastMeasurementTime.minute(),
+              lastMeasurementTime.second());
+  }
+}
+
+// Changes within STATE_COMMIT_DELAY_MS of the first one share a single NVS write
+void markMeasurementStateDirty()
+{
+  if (!measurementStateDirty && activeChannel == 0)
+  {
+    measurementStateDirty = true;
+    measurementStateDirtySince = millis();
+  }
+}
+
+void commitMeasurementState()
+{
+  LastMeasurementState state;
+  state.time = config.lastMeasurementTime;
+  state.density = config.lastMeasurementValue;
+  state.angle = config.lastMeasurementAngle;
+  statePrefs.putBytes("last", &state, sizeof(state));
+  measurementStateDirty = false;
+}
+
+void serviceStateStore()
+{
+  if (measurementStateDirty && millis() - measurementStateDirtySince >= STATE_COMMIT_DELAY_MS)
   {
-    logSerial("Failed to save configuration to settings.json");
+    commitMeasurementState();
   }
 }
 
@@ -617,713 +2087,4192 @@ void setupWiFiHotspot()
   WiFi.softAP("ClaybathDensityMeter", "12345678");
 
   logSerial("WiFi Hotspot started");
-  logSerial("IP address: " + WiFi.softAPIP().toString());
+  IPAddress ip = WiFi.softAPIP();
+  logSerial("IP address: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+
+  if (networkConfig.enabled)
+  {
+    applyStationMode();
+  }
 }
 
-void setupWebServer()
+// Collect a small request body into request->_tempObject (freed with the request)
+void collectRequestBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
 {
-  // Serve static files from LittleFS
-  server.serveStatic("/", LittleFS, "/index.html");
+  if (total > MAX_REQUEST_BODY)
+  {
+    return;
+  }
+  if (index == 0)
+  {
+    request->_tempObject = malloc(total + 1);
+  }
+  if (request->_tempObject)
+  {
+    memcpy((uint8_t *)request->_tempObject + index, data, len);
+    if (index + len == total)
+    {
+      ((char *)request->_tempObject)[total] = '\0';
+    }
+  }
+}
 
-  // API endpoints
-  server.on("/api/status", HTTP_GET, []()
-            {
-  DynamicJsonDocument doc(1024);
-  doc["currentAngle"] = currentAngle;
-  doc["currentDensity"] = currentDensity;
-  doc["lastMeasurement"] = lastMeasurement;
-  doc["lastMeasurementTime"] = config.lastMeasurementTime;
-  doc["lastMeasurementAngle"] = config.lastMeasurementAngle;
-  doc["nextMeasurementTime"] = nextMeasurementTime.unixtime() > 0 ? nextMeasurementTime.unixtime() : 0;
-  doc["isMeasuring"] = isMeasuring;
-  doc["isManualMode"] = isManualMode;
-  doc["hasScheduledMeasurement"] = nextMeasurementTime.unixtime() > 0;
-  doc["autoMeasurementEnabled"] = config.autoMeasurementEnabled; // NEW
-  
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response); });
+// Parse the collected JSON body. On failure the error response has been sent.
+bool parseRequestBody(AsyncWebServerRequest *request, JsonDocument &doc)
+{
+  if (!request->_tempObject)
+  {
+    request->send(400, "application/json", "{\"error\":\"no_data\"}");
+    return false;
+  }
+  // Non-const input: strings stay in the body buffer instead of being copied
+  if (deserializeJson(doc, (char *)request->_tempObject))
+  {
+    request->send(400, "application/json", "{\"error\":\"invalid_json\"}");
+    return false;
+  }
+  return true;
+}
 
-  // Add new API endpoint for file list
-  server.on("/api/files", HTTP_GET, []()
-            {
-    String fileList = getFileList();
-    server.send(200, "application/json", fileList); });
+// ?channel= of a request, 0 when absent. Returns -1, with the error response
+// sent, for a channel without a probe.
+int requestChannel(AsyncWebServerRequest *request)
+{
+  int channel = request->hasParam("channel") ? request->getParam("channel")->value().toInt() : 0;
+  if (channel < 0 || channel >= PROBE_CHANNELS || !channelPresent[channel])
+  {
+    request->send(400, "application/json", "{\"error\":\"invalid_channel\"}");
+    return -1;
+  }
+  return channel;
+}
 
-  // Updated API endpoint for serial output
-  server.on("/api/serial", HTTP_GET, []()
-            {
-    DynamicJsonDocument doc(4096);
-    doc["output"] = getSerialBuffer();
-    doc["totalMessages"] = totalMessages;
-    doc["bufferSize"] = SERIAL_BUFFER_SIZE;
-    
-    String response;
-    serializeJson(doc, response);
-    server.send(200, "application/json", response); });
+// The shared handler document, emptied (web handlers only)
+JsonDocument &apiDocument()
+{
+  apiDoc.clear();
+  return apiDoc;
+}
 
-  // Add API endpoint to clear serial buffer
-  server.on("/api/serial/clear", HTTP_POST, []()
-            {
-    clearSerialBuffer();
-    logSerial("Serial buffer cleared via web interface");
-    server.send(200, "application/json", "{\"status\":\"success\"}"); });
+// Serialize straight into the response buffer, sized up front so it is
+// allocated once (the ring buffer keeps one byte free)
+void sendJson(AsyncWebServerRequest *request, const JsonDocument &doc, int code = 200)
+{
+  AsyncResponseStream *response = request->beginResponseStream("application/json", measureJson(doc) + 1);
+  response->setCode(code);
+  serializeJson(doc, *response);
+  request->send(response);
+}
 
-  // FIXED: Add missing GET handler for individual file downloads
-  server.on("/api/file", HTTP_GET, []()
-            {
-    if (server.hasArg("name")) {
-      String filename = server.arg("name");
-      
-      // Add leading slash if not present
-      if (!filename.startsWith("/")) {
-        filename = "/" + filename;
-      }
-      
-      if (LittleFS.exists(filename)) {
-        File file = LittleFS.open(filename, "r");
-        if (file) {
-          // Set appropriate headers for file download
-          String contentType = "application/octet-stream";
-          if (filename.endsWith(".csv")) {
-            contentType = "text/csv";
-          } else if (filename.endsWith(".json")) {
-            contentType = "application/json";
-          }
-          
-          server.sendHeader("Content-Disposition", "attachment; filename=\"" + filename.substring(1) + "\"");
-          server.streamFile(file, contentType);
-          file.close();
-          
-          logSerial("File downloaded: " + filename);
-        } else {
-          server.send(500, "application/json", "{\"error\":\"failed_to_open_file\"}");
+// Producer side (web handlers only): fill commandSlot(0..count-1), then
+// publishCommands(count). Slots left unpublished are simply reused.
+int commandSpace()
+{
+  return CONTROL_QUEUE_LENGTH - (commandHead.load(std::memory_order_relaxed) -
+                                 commandTail.load(std::memory_order_acquire));
+}
+
+ControlCommand &commandSlot(int offset)
+{
+  return commandRing[(commandHead.load(std::memory_order_relaxed) + offset) & (CONTROL_QUEUE_LENGTH - 1)];
+}
+
+// Hand 'count' filled slots to the control loop as one batch; returns its token
+uint32_t publishCommands(int count)
+{
+  uint32_t token = nextCommandToken++;
+  for (int i = 0; i < count; i++)
+  {
+    commandSlot(i).token = token;
+    commandSlot(i).batchEnd = i == count - 1;
+  }
+  commandHead.store(commandHead.load(std::memory_order_relaxed) + count, std::memory_order_release);
+  xTaskNotifyGive(controlTaskHandle);
+  return token;
+}
+
+// Hand a command to the control loop. Returns its token, 0 if the ring is full.
+uint32_t postControlCommand(const ControlCommand &command)
+{
+  if (commandSpace() < 1)
+  {
+    return 0;
+  }
+  commandSlot(0) = command;
+  return publishCommands(1);
+}
+
+// Result of a posted command or batch: "pending", "done", "rejected" (with
+// 'error') or "unknown" for tokens never issued or no longer kept
+const char *commandResult(uint32_t token, const char *&error)
+{
+  error = NULL;
+  const char *status = "unknown";
+  portENTER_CRITICAL(&commandResultMux);
+  const CommandResult &result = commandResults[token % CONTROL_RESULT_SLOTS];
+  if (token > 0 && result.token == token)
+  {
+    error = result.error;
+    status = error ? "rejected" : "done";
+  }
+  else if (token > completedToken && token < nextCommandToken)
+  {
+    status = "pending";
+  }
+  portEXIT_CRITICAL(&commandResultMux);
+  return status;
+}
+
+// Copy of the control loop's published state
+StatusSnapshot readStatusSnapshot()
+{
+  StatusSnapshot snapshot;
+  portENTER_CRITICAL(&statusMux);
+  snapshot = statusSnapshot;
+  portEXIT_CRITICAL(&statusMux);
+  return snapshot;
+}
+
+Config readChannelConfig(int channel)
+{
+  Config settings;
+  portENTER_CRITICAL(&statusMux);
+  settings = publishedConfigs[channel];
+  portEXIT_CRITICAL(&statusMux);
+  return settings;
+}
+
+// Name of the first setting outside its accepted range, NULL if all are valid
+const char *invalidConfigField(const Config &settings)
+{
+  if (!(settings.desiredDensity >= DENSITY_MIN && settings.desiredDensity <= DENSITY_MAX))
+    return "desiredDensity";
+  if (settings.measurementInterval < 1 || settings.measurementInterval > 1440)
+    return "measurementInterval";
+  if (settings.fillDurationMs > CONFIG_MAX_VALVE_MS)
+    return "fillDurationMs";
+  if (settings.emptyDurationMs > CONFIG_MAX_VALVE_MS)
+    return "emptyDurationMs";
+  if (settings.seriesFlushMs > CONFIG_MAX_VALVE_MS)
+    return "seriesFlushMs";
+  if (settings.waitDuration < 0 || settings.waitDuration > 3600)
+    return "waitDuration";
+  if (settings.measurementDuration < 1 || settings.measurementDuration > 600)
+    return "measurementDuration";
+  if (settings.acquisitionMode != ACQ_FIFO && settings.acquisitionMode != ACQ_DATA_READY)
+    return "acquisitionMode";
+  if (!(settings.convergenceThreshold >= 0 && settings.convergenceThreshold <= 5))
+    return "convergenceThreshold";
+  if (settings.settleStableSeconds < 0 || settings.settleStableSeconds > 600)
+    return "settleStableSeconds";
+  if (!(settings.settleThreshold >= 0 && settings.settleThreshold <= 10))
+    return "settleThreshold";
+  if (!(settings.calibrationOffset >= -90 && settings.calibrationOffset <= 90))
+    return "calibrationOffset";
+  if (!(settings.calibrationScale > 0 && settings.calibrationScale <= 10))
+    return "calibrationScale";
+  if (!(settings.targetAngleMin >= -90 && settings.targetAngleMin < settings.targetAngleMax &&
+        settings.targetAngleMax <= 90))
+    return "targetAngle";
+  return NULL;
+}
+
+// Loaded settings get the same range checks as /api/config; a field outside
+// its range falls back to the default instead of rejecting the whole file
+void repairConfigFields(Config &settings)
+{
+  static const Config defaults;
+  const char *field;
+  while ((field = invalidConfigField(settings)) != NULL)
+  {
+    logSerial("Setting %s out of range, using the default", field);
+    if (strcmp(field, "desiredDensity") == 0)
+      settings.desiredDensity = defaults.desiredDensity;
+    else if (strcmp(field, "measurementInterval") == 0)
+      settings.measurementInterval = defaults.measurementInterval;
+    else if (strcmp(field, "fillDurationMs") == 0)
+      settings.fillDurationMs = defaults.fillDurationMs;
+    else if (strcmp(field, "emptyDurationMs") == 0)
+      settings.emptyDurationMs = defaults.emptyDurationMs;
+    else if (strcmp(field, "seriesFlushMs") == 0)
+      settings.seriesFlushMs = defaults.seriesFlushMs;
+    else if (strcmp(field, "waitDuration") == 0)
+      settings.waitDuration = defaults.waitDuration;
+    else if (strcmp(field, "measurementDuration") == 0)
+      settings.measurementDuration = defaults.measurementDuration;
+    else if (strcmp(field, "acquisitionMode") == 0)
+      settings.acquisitionMode = defaults.acquisitionMode;
+    else if (strcmp(field, "convergenceThreshold") == 0)
+      settings.convergenceThreshold = defaults.convergenceThreshold;
+    else if (strcmp(field, "settleStableSeconds") == 0)
+      settings.settleStableSeconds = defaults.settleStableSeconds;
+    else if (strcmp(field, "settleThreshold") == 0)
+      settings.settleThreshold = defaults.settleThreshold;
+    else if (strcmp(field, "calibrationOffset") == 0)
+      settings.calibrationOffset = defaults.calibrationOffset;
+    else if (strcmp(field, "calibrationScale") == 0)
+      settings.calibrationScale = defaults.calibrationScale;
+    else if (strcmp(field, "targetAngle") == 0)
+    {
+      settings.targetAngleMin = defaults.targetAngleMin;
+      settings.targetAngleMax = defaults.targetAngleMax;
+    }
+    else
+      break; // A check without a default here; keep what was loaded
+  }
+}
+
+void fillChannelStatus(ChannelStatus &status, MeasurementState state, bool measuring, int replicate,
+                       int replicates, float last, DateTime next, const Config &settings)
+{
+  status.measurementState = state;
+  status.isMeasuring = measuring;
+  status.autoMeasurementEnabled = settings.autoMeasurementEnabled;
+  status.seriesIndex = replicate;
+  status.seriesTarget = replicates;
+  status.lastMeasurement = last;
+  status.lastMeasurementAngle = settings.lastMeasurementAngle;
+  status.lastMeasurementTime = settings.lastMeasurementTime;
+  status.nextMeasurementTime = next.unixtime();
+}
+
+// Publish state for the web handlers (control loop, channel 0 selected).
+// Everything is assembled outside the spinlock, which only covers the copy.
+void publishStatus()
+{
+  static StatusSnapshot next; // Control loop only
+  static Config configs[PROBE_CHANNELS];
+
+  next.currentAngle = currentAngle;
+  next.currentDensity = currentDensity;
+  next.liveAngle = liveAngle;
+  next.liveDensity = angleToDensity(liveAngle);
+  next.lastMeasurement = lastMeasurement;
+  next.lastMeasurementStdDev = lastMeasurementStdDev;
+  next.lastMeasurementSamples = lastMeasurementSamples;
+  next.nextMeasurementTime = nextMeasurementTime.unixtime();
+  next.measurementState = measurementState;
+  next.stateStartTime = stateStartTime;
+  next.seriesIndex = seriesIndex;
+  next.seriesTarget = seriesTarget;
+  next.isMeasuring = isMeasuring;
+  next.isManualMode = isManualMode;
+  next.config = config;
+  fillChannelStatus(next.channels[0], measurementState, isMeasuring, seriesIndex, seriesTarget,
+                    lastMeasurement, nextMeasurementTime, config);
+  configs[0] = config;
+  for (int channel = 1; channel < PROBE_CHANNELS; channel++)
+  {
+    const ChannelContext &context = channelContexts[channel];
+    fillChannelStatus(next.channels[channel], context.measurementState, context.isMeasuring,
+                      context.seriesIndex, context.seriesTarget, context.lastMeasurement,
+                      context.nextMeasurementTime, context.config);
+    configs[channel] = context.config;
+  }
+
+  portENTER_CRITICAL(&statusMux);
+  memcpy(&statusSnapshot, &next, sizeof(next));
+  memcpy(publishedConfigs, configs, sizeof(configs));
+  portEXIT_CRITICAL(&statusMux);
+}
+
+// Fill the next block of the CSV export. Returns false when the export is complete.
+bool refillDataStream(DataStreamState &stream)
+{
+  stream.offset = 0;
+  stream.length = 0;
+
+  switch (stream.stage)
+  {
+  case 0:
+    stream.length = snprintf(stream.buffer, sizeof(stream.buffer), "Timestamp,Density,Angle,StdDev,Samples,Flags,Replicates,Channel\n");
+
+    // Rows from the per-day CSV files written by older firmware; their names
+    // don't carry a sortable date, so they are only included in full exports
+    if (stream.from == 0 && stream.to == LOG_EMPTY_TIMESTAMP)
+    {
+      stream.catalogIndex = 0;
+      stream.stage = 1;
+    }
+    else
+    {
+      stream.stage = 2;
+    }
+    return true;
+
+  case 1:
+    for (;;)
+    {
+      // Legacy rows are Timestamp,Density,Angle; pad them to the log's columns
+      // (no spread or sample count, no flags, channel 0)
+      while (stream.legacy && stream.legacy.available() &&
+             sizeof(stream.buffer) - stream.length >= DATA_STREAM_ROW_MAX)
+      {
+        char row[DATA_STREAM_ROW_MAX];
+        size_t length = stream.legacy.readBytesUntil('\n', row, sizeof(row) - 16);
+        while (length > 0 && (row[length - 1] == '\r' || row[length - 1] == ' '))
+        {
+          length--;
+        }
+        if (length == 0 || row[0] < '0' || row[0] > '9')
+        {
+          continue; // Blank line or header
+        }
+        memcpy(stream.buffer + stream.length, row, length);
+        stream.length += length;
+        stream.length += snprintf(stream.buffer + stream.length, sizeof(stream.buffer) - stream.length, ",,,0,0,0\n");
+      }
+      if (stream.length > 0)
+      {
+        return true;
+      }
+      if (stream.legacy)
+      {
+        stream.legacy.close();
+      }
+
+      CatalogEntry entry;
+      if (!catalogEntry(stream.catalogIndex++, entry))
+      {
+        stream.stage = 2;
+        return refillDataStream(stream);
+      }
+
+      if (isLegacyDataFile(entry.name))
+      {
+        stream.legacy = LittleFS.open(entry.name, "r");
+        stream.legacy.setTimeout(0); // A short last line must not wait for more data
+      }
+    }
+
+  case 2:
+  {
+    LogRecord record;
+    xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+    if (!stream.seeked)
+    {
+      logSeek(stream.cursor, stream.from);
+      stream.seeked = true;
+    }
+    while (sizeof(stream.buffer) - stream.length >= DATA_STREAM_ROW_MAX)
+    {
+      if (!logNext(stream.cursor, record) || record.timestamp > stream.to)
+      {
+        stream.stage = 3;
+        break;
+      }
+      stream.length += formatLogRecordCsv(record, stream.buffer + stream.length,
+                                          sizeof(stream.buffer) - stream.length);
+    }
+    xSemaphoreGive(logStoreMutex);
+    return stream.length > 0;
+  }
+
+  default:
+    return false;
+  }
+}
+
+// Chunked response filler for /api/data
+size_t fillDataStream(DataStreamState &stream, uint8_t *buffer, size_t maxLen)
+{
+  while (stream.offset == stream.length)
+  {
+    if (!refillDataStream(stream))
+    {
+      return 0; // End of response
+    }
+  }
+
+  size_t n = min(maxLen, stream.length - stream.offset);
+  memcpy(buffer, stream.buffer + stream.offset, n);
+  stream.offset += n;
+  return n;
+}
+
+// Apply commands posted by the web handlers (control loop only). Runs once per
+// loop pass, before the state machine, so commands never interleave with its
+// valve sequencing. After a failed command the rest of its batch is skipped.
+void processControlCommands()
+{
+  uint32_t tail = commandTail.load(std::memory_order_relaxed);
+  uint32_t head = commandHead.load(std::memory_order_acquire);
+  const char *error = NULL;
+
+  for (; tail != head; tail++)
+  {
+    // The slot stays ours until commandTail moves past it
+    const ControlCommand &command = commandRing[tail & (CONTROL_QUEUE_LENGTH - 1)];
+    if (!error && (command.channel >= PROBE_CHANNELS || !channelPresent[command.channel]))
+    {
+      error = "channel_unavailable";
+    }
+    else if (!error)
+    {
+      selectChannel(command.channel);
+      error = applyControlCommand(command);
+      selectChannel(0);
+    }
+
+    if (command.batchEnd)
+    {
+      portENTER_CRITICAL(&commandResultMux);
+      CommandResult &result = commandResults[command.token % CONTROL_RESULT_SLOTS];
+      result.token = command.token;
+      result.error = error;
+      completedToken = command.token;
+      portEXIT_CRITICAL(&commandResultMux);
+      if (error)
+      {
+        logSerial("Command %u rejected: %s", (unsigned)command.token, error);
+      }
+      error = NULL;
+    }
+    commandTail.store(tail + 1, std::memory_order_release);
+  }
+}
+
+// Returns NULL when applied, otherwise why the command was refused. Runs with
+// the command's channel selected.
+const char *applyControlCommand(const ControlCommand &command)
+{
+  switch (command.type)
+  {
+  case CMD_MEASURE:
+    if (isMeasuring)
+    {
+      return "measurement_in_progress";
+    }
+    performMeasurement(command.replicates);
+    logSerial("Manual measurement started via web interface");
+    break;
+
+  case CMD_RELAY:
+    // The valves belong to the state machine while a cycle runs
+    if (isMeasuring && command.relay != RELAY_MEASURING)
+    {
+      return "measurement_in_progress";
+    }
+    if (command.relay == RELAY_FILL || command.relay == RELAY_EMPTY)
+    {
+      ValveTimer &valve = command.relay == RELAY_FILL ? *fillValve : *emptyValve;
+      const char *name = command.relay == RELAY_FILL ? "Fill" : "Empty";
+      cancelValve(valve); // Manual control takes over a timed run
+      if (command.state && command.durationMs > 0)
+      {
+        openValveFor(valve, command.durationMs);
+        logSerial("%s solenoid opened for %u ms via web interface", name, (unsigned)command.durationMs);
+      }
+      else
+      {
+        digitalWrite(valve.pin, command.state ? LOW : HIGH);
+        logSerial("%s solenoid %s via web interface", name, command.state ? "activated" : "deactivated");
+      }
+    }
+    else if (command.relay == RELAY_MEASURING)
+    {
+      digitalWrite(MEASURING_RELAY_PIN, command.state ? LOW : HIGH);
+      logSerial("Measuring relay %s via web interface", command.state ? "activated" : "deactivated");
+    }
+    break;
+
+  case CMD_UPDATE_CONFIG:
+  {
+    // Settings come from the request, measurement results stay ours
+    Config updated = command.config;
+    updated.lastMeasurementValue = config.lastMeasurementValue;
+    updated.lastMeasurementTime = config.lastMeasurementTime;
+    updated.lastMeasurementAngle = config.lastMeasurementAngle;
+
+    if (activeChannel > 0)
+    {
+      // Sampling settings are controller-wide and set through channel 0
+      updated.sampleRateHz = config.sampleRateHz;
+      updated.acquisitionMode = config.acquisitionMode;
+    }
+    else if (updated.sampleRateHz != config.sampleRateHz || updated.acquisitionMode != config.acquisitionMode)
+    {
+      publishAcquisition(0, updated);
+      for (int channel = 1; channel < PROBE_CHANNELS; channel++)
+      {
+        channelContexts[channel].config.sampleRateHz = updated.sampleRateHz;
+        channelContexts[channel].config.acquisitionMode = updated.acquisitionMode;
+        publishAcquisition(channel, updated);
+      }
+      acquisitionReconfigure = true;
+    }
+    config = updated;
+    buildCalibrationLut();
+
+    // Save the updated configuration
+    saveConfig();
+    logSerial("Configuration updated via web interface");
+    break;
+  }
+
+  case CMD_SET_TIME:
+  {
+    // Set DS3231 RTC time
+    setClock(command.unixTime);
+
+    // Verify the time was set
+    syncClock();
+    DateTime now = nowDateTime();
+    logSerial("RTC time set to: %d/%d/%d %d:%02d:%02d",
+              now.year(), now.month(), now.day(), now.hour(), now.minute(), now.second());
+    break;
+  }
+
+  case CMD_DELETE_DATA:
+    deleteMeasurementData();
+    logSerial("All measurement data deleted via web interface");
+    break;
+
+  case CMD_DELETE_RANGE:
+    deleteMeasurementRange(command.unixTime, command.rangeEnd);
+    break;
+
+  case CMD_CAPTURE:
+    armCapture(command.state);
+    break;
+
+  case CMD_NEW_BATCH:
+    startBatch(command.name);
+    break;
+  }
+  return NULL;
+}
+
+// Human readable name of a measurement state (status events and UI)
+const char *measurementStateName(MeasurementState state)
+{
+  switch (state)
+  {
+  case EMPTYING_INITIAL:
+    return "PREPARING";
+  case FILLING:
+    return "FILLING";
+  case WAITING_TO_SETTLE:
+    return "SETTLING";
+  case MEASURING:
+    return "MEASURING";
+  case EMPTYING_FINAL:
+    return "EMPTYING";
+  case EXCHANGING:
+    return "EXCHANGING";
+  default:
+    return "IDLE";
+  }
+}
+
+// Serialize the status fields shared by /api/status and the "status" event
+void fillStatusJson(JsonDocument &doc, const StatusSnapshot &status)
+{
+  doc["currentAngle"] = status.currentAngle;
+  doc["currentDensity"] = status.currentDensity;
+  doc["liveAngle"] = status.liveAngle;
+  doc["liveDensity"] = status.liveDensity;
+  doc["lastMeasurement"] = status.lastMeasurement;
+  doc["lastMeasurementTime"] = status.config.lastMeasurementTime;
+  doc["lastMeasurementAngle"] = status.config.lastMeasurementAngle;
+  doc["lastMeasurementStdDev"] = status.lastMeasurementStdDev;
+  doc["lastMeasurementSamples"] = status.lastMeasurementSamples;
+  doc["nextMeasurementTime"] = status.nextMeasurementTime;
+  doc["state"] = measurementStateName((MeasurementState)status.measurementState);
+  doc["isMeasuring"] = status.isMeasuring;
+  doc["seriesIndex"] = status.seriesIndex;
+  doc["seriesReplicates"] = status.seriesTarget;
+  doc["isManualMode"] = status.isManualMode;
+  doc["hasScheduledMeasurement"] = status.nextMeasurementTime > 0;
+  doc["autoMeasurementEnabled"] = status.config.autoMeasurementEnabled; // NEW
+
+  if (PROBE_CHANNELS > 1)
+  {
+    JsonArray channels = doc.createNestedArray("channels");
+    for (int i = 0; i < PROBE_CHANNELS; i++)
+    {
+      const ChannelStatus &channel = status.channels[i];
+      JsonObject entry = channels.createNestedObject();
+      entry["channel"] = i;
+      entry["present"] = channelPresent[i];
+      entry["state"] = measurementStateName((MeasurementState)channel.measurementState);
+      entry["isMeasuring"] = channel.isMeasuring;
+      entry["lastMeasurement"] = channel.lastMeasurement;
+      entry["lastMeasurementAngle"] = channel.lastMeasurementAngle;
+      entry["lastMeasurementTime"] = channel.lastMeasurementTime;
+      entry["nextMeasurementTime"] = channel.nextMeasurementTime;
+      entry["seriesIndex"] = channel.seriesIndex;
+      entry["seriesReplicates"] = channel.seriesTarget;
+      entry["autoMeasurementEnabled"] = channel.autoMeasurementEnabled;
+    }
+  }
+}
+
+// Fields of the snapshot whose change is worth a status event
+uint32_t statusEventKey(const StatusSnapshot &status)
+{
+  struct __attribute__((packed))
+  {
+    uint8_t state;
+    bool measuring;
+    uint8_t seriesIndex;
+    uint32_t lastMeasurementTime;
+    bool autoMeasurement;
+    uint32_t nextMeasurementTime;
+  } key = {status.measurementState, status.isMeasuring, status.seriesIndex,
+           (uint32_t)status.config.lastMeasurementTime, status.config.autoMeasurementEnabled,
+           status.nextMeasurementTime};
+  uint32_t crc = crc32_le(0, (const uint8_t *)&key, sizeof(key));
+  return crc32_le(crc, (const uint8_t *)status.channels, sizeof(status.channels));
+}
+
+// Format the next event due for this client: a status change, the live angle
+// or the next log line, in that order. Returns false if nothing is due.
+bool nextStreamEvent(EventStreamState &stream, const StatusSnapshot &status)
+{
+  size_t size = sizeof(stream.event);
+  stream.offset = 0;
+  stream.length = 0;
+
+  uint32_t key = statusEventKey(status);
+  if (!stream.statusSent || key != stream.statusKey)
+  {
+    JsonDocument &doc = apiDocument();
+    fillStatusJson(doc, status);
+    int head = snprintf(stream.event, size, "event: status\ndata: ");
+    if (measureJson(doc) + head + 3 <= size)
+    {
+      stream.length = head + serializeJson(doc, stream.event + head, size - head);
+      stream.length += snprintf(stream.event + stream.length, size - stream.length, "\n\n");
+    }
+    stream.statusKey = key;
+    stream.statusSent = true;
+    return stream.length > 0;
+  }
+
+  // Live angle while the chamber is active, throttled and only on change
+  if (status.isMeasuring && millis() - stream.lastAnglePush >= EVENT_ANGLE_INTERVAL_MS &&
+      !(fabsf(status.liveAngle - stream.lastAngle) < 0.01f))
+  {
+    stream.length = snprintf(stream.event, size, "event: angle\ndata: {\"angle\":%.2f,\"density\":%.4f}\n\n",
+                             status.liveAngle, status.liveDensity);
+    stream.lastAngle = status.liveAngle;
+    stream.lastAnglePush = millis();
+    return true;
+  }
+
+  LogMessage entry;
+  xSemaphoreTake(serialBufferMutex, portMAX_DELAY);
+  uint32_t oldest = oldestSerialSeq();
+  // Lines older than the ring are gone; an id from before a reboot restarts the replay
+  uint32_t next = (stream.logSeq < oldest || stream.logSeq > logSequence) ? oldest : stream.logSeq;
+  bool available = next < logSequence;
+  if (available)
+  {
+    entry = serialEntry(next);
+  }
+  xSemaphoreGive(serialBufferMutex);
+  if (!available)
+  {
+    return false;
+  }
+
+  // The event id is the sequence number so EventSource can resume with Last-Event-ID
+  stream.length = snprintf(stream.event, size, "id: %u\nevent: log\ndata: %s\n\n",
+                           (unsigned)(entry.seq + 1), entry.message);
+  stream.logSeq = entry.seq + 1;
+  return true;
+}
+
+// Chunked response filler for /api/events; nothing due means try again later
+size_t fillEventStream(EventStreamState &stream, uint8_t *buffer, size_t maxLen)
+{
+  StatusSnapshot status = readStatusSnapshot();
+  size_t written = 0;
+  while (written < maxLen)
+  {
+    if (stream.offset == stream.length && !nextStreamEvent(stream, status))
+    {
+      break;
+    }
+    size_t chunk = min(maxLen - written, stream.length - stream.offset);
+    memcpy(buffer + written, stream.event + stream.offset, chunk);
+    written += chunk;
+    stream.offset += chunk;
+  }
+  return written > 0 ? written : RESPONSE_TRY_AGAIN;
+}
+
+// Server-Sent Events for status changes, live angle and log lines, so the UI
+// doesn't have to poll
+void setupEventSource()
+{
+  server.on("/api/events", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (eventClients >= EVENT_MAX_CLIENTS) {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+      return;
+    }
+    EventStreamState *state = new (std::nothrow) EventStreamState();
+    if (!state) {
+      request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+      return;
+    }
+    eventClients++;
+    std::shared_ptr<EventStreamState> stream(state);
+
+    // Resume after the last line this client saw, or replay the whole ring
+    stream->logSeq = request->hasHeader("Last-Event-ID")
+                         ? strtoul(request->getHeader("Last-Event-ID")->value().c_str(), NULL, 10)
+                         : 0;
+    stream->lastAngle = NAN;
+    stream->length = snprintf(stream->event, sizeof(stream->event), "retry: %d\n\n", EVENT_RETRY_MS);
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("text/event-stream",
+        [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+        { return fillEventStream(*stream, buffer, maxLen); });
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response); });
+}
+
+// Add one duration to a histogram. Callable from any task.
+void recordMetric(MetricId id, uint32_t us)
+{
+  int bucket = us == 0 ? 0 : min(32 - __builtin_clz(us), METRICS_BUCKETS - 1);
+  portENTER_CRITICAL(&metricsMux);
+  MetricHistogram &h = metrics[id];
+  h.buckets[bucket]++;
+  h.count++;
+  h.sumUs += us;
+  if (us > h.maxUs)
+    h.maxUs = us;
+  portEXIT_CRITICAL(&metricsMux);
+}
+
+// Record the time since 'sinceUs' and return now, so stages can be chained
+int64_t recordStage(MetricId id, int64_t sinceUs)
+{
+  int64_t now = esp_timer_get_time();
+  recordMetric(id, (uint32_t)(now - sinceUs));
+  return now;
+}
+
+void writeMetricsJson(AsyncResponseStream *out, const MetricHistogram *snapshot)
+{
+  out->printf("{\"uptimeMs\":%lu,\"cpuMhz\":%u,\"heap\":{\"free\":%u,\"minFree\":%u,\"largestBlock\":%u},",
+              millis(), (unsigned)cpuFrequencyMhz, (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(),
+              (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  out->printf("\"sampleOverruns\":%u,\"dataReadyIrq\":%s,\"i2c\":[", (unsigned)sampleOverruns,
+              mpuDataReadySeen ? "true" : "false");
+  for (int i = 0; i < 2; i++)
+  {
+    I2cBusStats stats = readI2cStats(i);
+    out->printf("%s{\"clockHz\":%u,\"transactions\":%u,\"nacks\":%u,\"timeouts\":%u}", i ? "," : "",
+                (unsigned)stats.clockHz, (unsigned)stats.transactions,
+                (unsigned)stats.nacks, (unsigned)stats.timeouts);
+  }
+  out->print("],\"valves\":{");
+  for (int ch = 0; ch < PROBE_CHANNELS; ch++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      // "fill", "empty" for channel 0, "fill1", "empty1" for the next one
+      char name[12];
+      snprintf(name, sizeof(name), ch ? "%s%d" : "%s", i ? "empty" : "fill", ch);
+      const ValveTimer &valve = channelValves[ch][i];
+      out->printf("%s\"%s\":{\"runs\":%u,\"errorUs\":%d,\"maxErrorUs\":%d}", ch || i ? "," : "",
+                  name, (unsigned)valve.runs, (int)valve.errorUs, (int)valve.maxErrorUs);
+    }
+  }
+  out->print("},\"stages\":{");
+  for (int id = 0; id < METRIC_COUNT; id++)
+  {
+    const MetricHistogram &h = snapshot[id];
+    out->printf("%s\"%s\":{\"count\":%u,\"sumUs\":%llu,\"maxUs\":%u,\"buckets\":[", id ? "," : "",
+                metricNames[id], (unsigned)h.count, (unsigned long long)h.sumUs, (unsigned)h.maxUs);
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+    {
+      out->printf(b ? ",%u" : "%u", (unsigned)h.buckets[b]);
+    }
+    out->print("]}");
+  }
+  out->print("}}");
+}
+
+// Prometheus text exposition: cumulative 'le' buckets in microseconds
+void writeMetricsPrometheus(AsyncResponseStream *out, const MetricHistogram *snapshot)
+{
+  out->print("# TYPE claybath_stage_duration_us histogram\n");
+  for (int id = 0; id < METRIC_COUNT; id++)
+  {
+    const MetricHistogram &h = snapshot[id];
+    uint32_t cumulative = 0;
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+    {
+      cumulative += h.buckets[b];
+      out->printf("claybath_stage_duration_us_bucket{stage=\"%s\",le=\"%lu\"} %u\n",
+                  metricNames[id], 1UL << b, (unsigned)cumulative);
+    }
+    out->printf("claybath_stage_duration_us_bucket{stage=\"%s\",le=\"+Inf\"} %u\n", metricNames[id], (unsigned)h.count);
+    out->printf("claybath_stage_duration_us_sum{stage=\"%s\"} %llu\n", metricNames[id], (unsigned long long)h.sumUs);
+    out->printf("claybath_stage_duration_us_count{stage=\"%s\"} %u\n", metricNames[id], (unsigned)h.count);
+    out->printf("claybath_stage_duration_us_max{stage=\"%s\"} %u\n", metricNames[id], (unsigned)h.maxUs);
+  }
+
+  out->printf("claybath_heap_free_bytes %u\nclaybath_heap_min_free_bytes %u\nclaybath_heap_largest_block_bytes %u\n",
+              (unsigned)ESP.getFreeHeap(), (unsigned)ESP.getMinFreeHeap(),
+              (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  out->printf("claybath_cpu_mhz %u\nclaybath_sample_overruns %u\n", (unsigned)cpuFrequencyMhz, (unsigned)sampleOverruns);
+  out->printf("claybath_data_ready_irq %d\n", mpuDataReadySeen ? 1 : 0);
+  for (int i = 0; i < 2; i++)
+  {
+    I2cBusStats stats = readI2cStats(i);
+    out->printf("claybath_i2c_transactions_total{bus=\"%d\"} %u\n", i, (unsigned)stats.transactions);
+    out->printf("claybath_i2c_nacks_total{bus=\"%d\"} %u\n", i, (unsigned)stats.nacks);
+    out->printf("claybath_i2c_timeouts_total{bus=\"%d\"} %u\n", i, (unsigned)stats.timeouts);
+    out->printf("claybath_i2c_clock_hz{bus=\"%d\"} %u\n", i, (unsigned)stats.clockHz);
+  }
+  for (int ch = 0; ch < PROBE_CHANNELS; ch++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      const char *name = i ? "empty" : "fill";
+      const ValveTimer &valve = channelValves[ch][i];
+      out->printf("claybath_valve_runs_total{valve=\"%s\",channel=\"%d\"} %u\n", name, ch, (unsigned)valve.runs);
+      out->printf("claybath_valve_error_us{valve=\"%s\",channel=\"%d\"} %d\n", name, ch, (int)valve.errorUs);
+      out->printf("claybath_valve_max_error_us{valve=\"%s\",channel=\"%d\"} %d\n", name, ch, (int)valve.maxErrorUs);
+    }
+  }
+}
+
+// GET /api/metrics: JSON by default, Prometheus text with ?format=prometheus
+// or a text/plain Accept header. ?reset=1 clears the histograms after reading.
+void setupMetricsEndpoint()
+{
+  server.on("/api/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    std::unique_ptr<MetricHistogram[]> snapshot(new (std::nothrow) MetricHistogram[METRIC_COUNT]);
+    if (!snapshot) {
+      request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+      return;
+    }
+
+    portENTER_CRITICAL(&metricsMux);
+    memcpy(snapshot.get(), metrics, sizeof(metrics));
+    if (request->hasParam("reset"))
+      memset(metrics, 0, sizeof(metrics));
+    portEXIT_CRITICAL(&metricsMux);
+
+    bool prometheus = request->hasParam("format")
+                          ? request->getParam("format")->value() == "prometheus"
+                          : request->hasHeader("Accept") &&
+                                request->getHeader("Accept")->value().indexOf("text/plain") >= 0;
+
+    AsyncResponseStream *out = request->beginResponseStream(
+        prometheus ? "text/plain; version=0.0.4" : "application/json");
+    if (prometheus)
+      writeMetricsPrometheus(out, snapshot.get());
+    else
+      writeMetricsJson(out, snapshot.get());
+    request->send(out); });
+}
+
+void setupWebServer()
+{
+  // API endpoints
+  server.on("/api/status", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+  JsonDocument &doc = apiDocument();
+  fillStatusJson(doc, readStatusSnapshot());
+
+  // Bus health, so the clock choice is measured rather than guessed
+  JsonArray buses = doc.createNestedArray("i2c");
+  for (int i = 0; i < 2; i++) {
+    I2cBusStats stats = readI2cStats(i);
+    JsonObject bus = buses.createNestedObject();
+    bus["bus"] = i + 1;
+    bus["clockHz"] = stats.clockHz;
+    bus["transactions"] = stats.transactions;
+    bus["nacks"] = stats.nacks;
+    bus["timeouts"] = stats.timeouts;
+    bus["stepDowns"] = stats.stepDowns;
+  }
+
+  sendJson(request, doc); });
+
+  // File list from the catalog, one page per request: ?offset=&limit=
+  server.on("/api/files", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    int total = listedFileCount();
+    int offset = request->hasParam("offset") ? request->getParam("offset")->value().toInt() : 0;
+    int limit = request->hasParam("limit") ? request->getParam("limit")->value().toInt() : CATALOG_PAGE_DEFAULT;
+    offset = constrain(offset, 0, total);
+    limit = constrain(limit, 1, CATALOG_PAGE_MAX);
+
+    // Offsets count listed files; the stream walks catalog indices
+    std::shared_ptr<FileListStream> stream(new (std::nothrow) FileListStream());
+    if (!stream) {
+      request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+      return;
+    }
+    stream->first = listedCatalogIndex(offset);
+    stream->next = stream->first;
+    stream->end = listedCatalogIndex(min(offset + limit, total));
+    stream->length = snprintf(stream->buffer, sizeof(stream->buffer),
+                              "{\"total\":%d,\"offset\":%d,\"files\":[", total, offset);
+    stream->stage = 1;
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/json",
+        [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+        { return fillFileList(*stream, buffer, maxLen); });
+    request->send(response); });
+
+  // Bulk delete of the measurement files whose data lies within ?from=&to=
+  server.on("/api/files", HTTP_DELETE, [](AsyncWebServerRequest *request)
+            {
+    if (!request->hasParam("from") && !request->hasParam("to")) {
+      request->send(400, "application/json", "{\"error\":\"range_required\"}");
+      return;
+    }
+    ControlCommand command;
+    command.type = CMD_DELETE_RANGE;
+    command.unixTime = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10) : 0;
+    command.rangeEnd = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : LOG_EMPTY_TIMESTAMP;
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } });
+
+  // Updated API endpoint for serial output
+  server.on("/api/serial", HTTP_GET, handleSerial);
+
+  // Add API endpoint to clear serial buffer
+  server.on("/api/serial/clear", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    clearSerialBuffer();
+    logSerial("Serial buffer cleared via web interface");
+    request->send(200, "application/json", "{\"status\":\"success\"}"); });
+
+  // FIXED: Add missing GET handler for individual file downloads
+  server.on("/api/file", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (request->hasParam("name")) {
+      String filename = request->getParam("name")->value();
+      
+      // Add leading slash if not present
+      if (!filename.startsWith("/")) {
+        filename = "/" + filename;
+      }
+      if (isProtectedFile(filename.c_str())) {
+        request->send(403, "application/json", "{\"error\":\"protected_file\"}");
+        return;
+      }
+      
+      if (LittleFS.exists(filename)) {
+        // Set appropriate headers for file download
+        String contentType = "application/octet-stream";
+        if (filename.endsWith(".csv")) {
+          contentType = "text/csv";
+        } else if (filename.endsWith(".json")) {
+          contentType = "application/json";
+        }
+        
+        request->send(LittleFS, filename, contentType, true);
+        logSerial("File downloaded: %s", filename.c_str());
+      } else {
+        request->send(404, "application/json", "{\"error\":\"file_not_found\"}");
+      }
+    } else {
+      request->send(400, "application/json", "{\"error\":\"filename_required\"}");
+    } });
+
+  // Add new API endpoint for individual file operations (DELETE)
+  server.on("/api/file", HTTP_DELETE, [](AsyncWebServerRequest *request)
+            {
+    if (request->hasParam("name")) {
+      String filename = request->getParam("name")->value();
+      if (!filename.startsWith("/")) {
+        filename = "/" + filename;
+      }
+      if (isProtectedFile(filename.c_str())) {
+        request->send(403, "application/json", "{\"error\":\"protected_file\"}");
+        return;
+      }
+      bool success = deleteFile(filename);
+      
+      JsonDocument &doc = apiDocument();
+      doc["success"] = success;
+      doc["message"] = success ? "File deleted successfully" : "Failed to delete file";
+      
+      sendJson(request, doc, success ? 200 : 400);
+    } else {
+      request->send(400, "application/json", "{\"error\":\"filename_required\"}");
+    } });
+
+  server.on("/api/config", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+  int channel = requestChannel(request);
+  if (channel < 0) {
+    return;
+  }
+  Config current = readChannelConfig(channel);
+  JsonDocument &doc = apiDocument();
+  doc["channel"] = channel;
+  doc["desiredDensity"] = current.desiredDensity;
+  doc["measurementInterval"] = current.measurementInterval;
+  doc["fillDuration"] = current.fillDurationMs / 1000.0; // seconds, kept for older clients
+  doc["fillDurationMs"] = current.fillDurationMs;
+  doc["waitDuration"] = current.waitDuration;
+  doc["measurementDuration"] = current.measurementDuration;
+  doc["emptyDuration"] = current.emptyDurationMs / 1000.0;
+  doc["emptyDurationMs"] = current.emptyDurationMs;
+  doc["sampleRateHz"] = current.sampleRateHz;
+  doc["acquisitionMode"] = current.acquisitionMode;
+  doc["convergenceThreshold"] = current.convergenceThreshold;
+  doc["settleStableSeconds"] = current.settleStableSeconds;
+  doc["settleThreshold"] = current.settleThreshold;
+  doc["calibrationOffset"] = current.calibrationOffset;
+  doc["calibrationScale"] = current.calibrationScale;
+  doc["lastMeasurementValue"] = current.lastMeasurementValue;
+  doc["lastMeasurementTime"] = current.lastMeasurementTime;
+  doc["targetAngleMin"] = current.targetAngleMin;
+  doc["targetAngleMax"] = current.targetAngleMax;
+  doc["lastMeasurementAngle"] = current.lastMeasurementAngle;
+  doc["autoMeasurementEnabled"] = current.autoMeasurementEnabled; // NEW
+  doc["seriesReplicates"] = current.seriesReplicates;
+  doc["seriesFlushMs"] = current.seriesFlushMs;
+  
+  sendJson(request, doc); });
+
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+
+    int channel = requestChannel(request);
+    if (channel < 0) {
+      return;
+    }
+
+    // Start from the current settings and update values present in the request
+    ControlCommand command;
+    command.type = CMD_UPDATE_CONFIG;
+    command.channel = channel;
+    command.config = readChannelConfig(channel);
+    Config &updated = command.config;
+
+    if (doc.containsKey("desiredDensity")) 
+      updated.desiredDensity = doc["desiredDensity"];
+    if (doc.containsKey("measurementInterval")) 
+      updated.measurementInterval = doc["measurementInterval"];
+    if (doc.containsKey("fillDurationMs")) 
+      updated.fillDurationMs = doc["fillDurationMs"];
+    else if (doc.containsKey("fillDuration")) // seconds, may be fractional
+      updated.fillDurationMs = lroundf(doc["fillDuration"].as<float>() * 1000);
+    if (doc.containsKey("waitDuration")) 
+      updated.waitDuration = doc["waitDuration"];
+    if (doc.containsKey("measurementDuration")) 
+      updated.measurementDuration = doc["measurementDuration"];
+    if (doc.containsKey("emptyDurationMs")) 
+      updated.emptyDurationMs = doc["emptyDurationMs"];
+    else if (doc.containsKey("emptyDuration"))
+      updated.emptyDurationMs = lroundf(doc["emptyDuration"].as<float>() * 1000);
+    if (doc.containsKey("sampleRateHz")) 
+      updated.sampleRateHz = achievableSampleRate(doc["sampleRateHz"]);
+    if (doc.containsKey("acquisitionMode")) 
+      updated.acquisitionMode = doc["acquisitionMode"];
+    if (doc.containsKey("convergenceThreshold")) 
+      updated.convergenceThreshold = doc["convergenceThreshold"];
+    if (doc.containsKey("settleStableSeconds")) 
+      updated.settleStableSeconds = doc["settleStableSeconds"];
+    if (doc.containsKey("settleThreshold")) 
+      updated.settleThreshold = doc["settleThreshold"];
+    if (doc.containsKey("calibrationOffset")) 
+      updated.calibrationOffset = doc["calibrationOffset"];
+    if (doc.containsKey("calibrationScale")) 
+      updated.calibrationScale = doc["calibrationScale"];
+    if (doc.containsKey("targetAngleMin")) 
+      updated.targetAngleMin = doc["targetAngleMin"];
+    if (doc.containsKey("targetAngleMax")) 
+      updated.targetAngleMax = doc["targetAngleMax"];
+    if (doc.containsKey("autoMeasurementEnabled")) 
+      updated.autoMeasurementEnabled = doc["autoMeasurementEnabled"];
+    if (doc.containsKey("seriesReplicates")) 
+      updated.seriesReplicates = constrain(doc["seriesReplicates"].as<int>(), 1, SERIES_MAX_REPLICATES);
+    if (doc.containsKey("seriesFlushMs")) 
+      updated.seriesFlushMs = doc["seriesFlushMs"];
+
+    const char *invalid = invalidConfigField(updated);
+    if (invalid) {
+      JsonDocument &error = apiDocument();
+      error["error"] = "out_of_range";
+      error["field"] = invalid;
+      sendJson(request, error, 400);
+      return;
+    }
+
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } }, NULL, collectRequestBody);
+
+  server.on("/api/calibration", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+  int channel = requestChannel(request);
+  if (channel < 0) {
+    return;
+  }
+  Config current = readChannelConfig(channel);
+  JsonDocument &doc = apiDocument();
+  doc["channel"] = channel;
+  doc["calibrationOffset"] = current.calibrationOffset;
+  doc["calibrationScale"] = current.calibrationScale;
+  doc["mode"] = current.calibrationPointCount >= 2 ? "points" : "linear";
+  JsonArray points = doc.createNestedArray("points");
+  for (int i = 0; i < current.calibrationPointCount; i++) {
+    JsonObject point = points.createNestedObject();
+    point["angle"] = current.calibrationAngles[i];
+    point["density"] = current.calibrationDensities[i];
+  }
+
+  sendJson(request, doc); });
+
+  server.on("/api/calibration", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+
+    int channel = requestChannel(request);
+    if (channel < 0) {
+      return;
+    }
+
+    ControlCommand command;
+    command.type = CMD_UPDATE_CONFIG;
+    command.channel = channel;
+    command.config = readChannelConfig(channel);
+
+    if (!doc["points"].is<JsonArray>() ||
+        !setCalibrationPoints(command.config, doc["points"].as<JsonArrayConst>())) {
+      request->send(400, "application/json", "{\"error\":\"invalid_calibration\"}");
+      return;
+    }
+
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } }, NULL, collectRequestBody);
+
+  server.on("/api/measure", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    int channel = requestChannel(request);
+    if (channel < 0) {
+      return;
+    }
+    ControlCommand command;
+    command.type = CMD_MEASURE;
+    command.channel = channel;
+    command.replicates = 1;
+    if (request->hasParam("replicates")) {
+      command.replicates = constrain(request->getParam("replicates")->value().toInt(), 1, SERIES_MAX_REPLICATES);
+    }
+    uint32_t token = 0;
+    if (readStatusSnapshot().channels[channel].isMeasuring) {
+      request->send(400, "application/json", "{\"error\":\"measurement_in_progress\"}");
+    } else if ((token = postControlCommand(command)) != 0) {
+      char response[64];
+      snprintf(response, sizeof(response), "{\"status\":\"measurement_started\",\"channel\":%d,\"token\":%u}",
+               channel, (unsigned)token);
+      request->send(200, "application/json", response);
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } });
+
+  server.on("/api/control", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+    
+    // One {action, state, duration_ms, channel} object, or an array of them applied in order
+    JsonArray steps = doc.is<JsonArray>() ? doc.as<JsonArray>() : JsonArray();
+    int count = steps.isNull() ? 1 : steps.size();
+    if (count < 1 || count > CONTROL_BATCH_MAX) {
+      request->send(400, "application/json", "{\"error\":\"invalid_batch\"}");
+      return;
+    }
+    if (commandSpace() < count) {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+      return;
+    }
+
+    for (int i = 0; i < count; i++) {
+      JsonVariant step = steps.isNull() ? doc.as<JsonVariant>() : steps[i];
+      const char *action = step["action"] | "";
+      ControlCommand &command = commandSlot(i);
+      command.type = CMD_RELAY;
+      command.state = step["state"];
+      command.durationMs = step["duration_ms"] | 0;
+      int channel = step["channel"] | 0;
+      if (channel < 0 || channel >= PROBE_CHANNELS || !channelPresent[channel]) {
+        request->send(400, "application/json", "{\"error\":\"invalid_channel\"}");
+        return;
+      }
+      command.channel = channel;
+
+      if (!strcmp(action, "fill_solenoid")) {
+        command.relay = RELAY_FILL;
+      } else if (!strcmp(action, "empty_solenoid")) {
+        command.relay = RELAY_EMPTY;
+      } else if (!strcmp(action, "measuring_relay")) {
+        command.relay = RELAY_MEASURING;
+      } else {
+        request->send(400, "application/json", "{\"error\":\"unknown_action\"}");
+        return;
+      }
+    }
+
+    char response[64];
+    snprintf(response, sizeof(response), "{\"status\":\"success\",\"token\":%u}",
+             (unsigned)publishCommands(count));
+    request->send(200, "application/json", response); }, NULL, collectRequestBody);
+
+  // Completion of a posted command: /api/control?token=
+  server.on("/api/control", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    if (!request->hasParam("token")) {
+      request->send(400, "application/json", "{\"error\":\"token_required\"}");
+      return;
+    }
+    uint32_t token = strtoul(request->getParam("token")->value().c_str(), NULL, 10);
+    const char *error;
+    JsonDocument &doc = apiDocument();
+    doc["token"] = token;
+    doc["status"] = commandResult(token, error);
+    if (error) {
+      doc["error"] = error;
+    }
+    sendJson(request, doc); });
+
+  server.on("/api/datetime", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+    
+    int year = doc["year"];
+    int month = doc["month"];
+    int day = doc["day"];
+    int hour = doc["hour"];
+    int minute = doc["minute"];
+    int second = doc["second"];
+    
+    ControlCommand command;
+    command.type = CMD_SET_TIME;
+    command.unixTime = DateTime(year, month, day, hour, minute, second).unixtime();
+    
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } }, NULL, collectRequestBody);
+
+  server.on("/api/data", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    // Optional ?from=&to= Unix timestamps select a time range
+    std::shared_ptr<DataStreamState> stream(new (std::nothrow) DataStreamState());
+    if (!stream) {
+      request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+      return;
+    }
+    stream->from = request->hasParam("from") ? strtoul(request->getParam("from")->value().c_str(), NULL, 10) : 0;
+    stream->to = request->hasParam("to") ? strtoul(request->getParam("to")->value().c_str(), NULL, 10) : LOG_EMPTY_TIMESTAMP;
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("text/csv",
+        [stream](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+        { return fillDataStream(*stream, buffer, maxLen); });
+    response->addHeader("Content-Disposition", "attachment; filename=\"measurements.csv\"");
+    request->send(response); });
+
+  server.on("/api/data", HTTP_DELETE, [](AsyncWebServerRequest *request)
+            {
+    ControlCommand command;
+    command.type = CMD_DELETE_DATA;
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } });
+
+  // Serve the main page and its assets
+  setupStaticAssets();
+
+  // Push channel for status, live angle and log lines
+  setupEventSource();
+  setupMetricsEndpoint();
+  setupCaptureEndpoints();
+  setupSummaryEndpoints();
+  setupNetworkEndpoints();
+
+  // Handle 404
+  server.onNotFound([](AsyncWebServerRequest *request)
+                    { request->send(404, "text/plain", "Not Found"); });
+
+  server.begin();
+  logSerial("Web server started");
+}
+
+// Find each page asset, preferring the gzipped copy, and derive its ETag.
+// Assets only change with a filesystem upload, which reboots the board.
+void setupStaticAssets()
+{
+  uint8_t chunk[512];
+  for (size_t i = 0; i < sizeof(staticAssets) / sizeof(staticAssets[0]); i++)
+  {
+    StaticAsset &asset = staticAssets[i];
+    String path = String(asset.path) + ".gz";
+    asset.gzipped = LittleFS.exists(path);
+    if (!asset.gzipped)
+    {
+      path = asset.path;
+    }
+
+    File file = LittleFS.open(path, "r");
+    if (file)
+    {
+      uint32_t crc = 0;
+      size_t n;
+      while ((n = file.read(chunk, sizeof(chunk))) > 0)
+      {
+        crc = crc32_le(crc, chunk, n);
+      }
+      snprintf(asset.etag, sizeof(asset.etag), "\"%08x\"", (unsigned)crc);
+      logSerial("Asset %s: %u bytes%s, ETag %s", path.c_str(), (unsigned)file.size(),
+                asset.gzipped ? " (gzip)" : "", asset.etag);
+      file.close();
+    }
+
+    StaticAsset *served = &asset;
+    server.on(asset.path, HTTP_GET, [served](AsyncWebServerRequest *request)
+              { serveStaticAsset(request, *served); });
+  }
+
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
+            { serveStaticAsset(request, staticAssets[0]); });
+}
+
+// 304 when the browser's copy is current, otherwise the stored file as is.
+// Every browser accepts gzip, so there is no uncompressed fallback.
+void serveStaticAsset(AsyncWebServerRequest *request, const StaticAsset &asset)
+{
+  if (asset.etag[0] == '\0')
+  {
+    request->send(404, "text/plain", String(asset.path + 1) + " not found");
+    return;
+  }
+
+  AsyncWebServerResponse *response;
+  if (request->hasHeader("If-None-Match") &&
+      request->getHeader("If-None-Match")->value().indexOf(asset.etag) >= 0)
+  {
+    response = request->beginResponse(304);
+  }
+  else
+  {
+    String path = asset.path;
+    if (asset.gzipped)
+    {
+      path += ".gz";
+    }
+    response = request->beginResponse(LittleFS, path, asset.contentType);
+    if (asset.gzipped)
+    {
+      response->addHeader("Content-Encoding", "gzip");
+    }
+  }
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", STATIC_CACHE_CONTROL);
+  request->send(response);
+}
+
+// File management functions
+
+// Per-day CSV written by older firmware, e.g. /data_2024115.csv
+bool isLegacyDataFile(const char *name)
+{
+  size_t length = strlen(name);
+  return strncmp(name, "/data_", 6) == 0 && length > 10 && strcmp(name + length - 4, ".csv") == 0;
+}
+
+// Credentials, settings blobs and the log internals: kept in the catalog for
+// range deletes, but neither listed by /api/files nor served or deleted by
+// /api/file. Measurement data leaves through /api/data instead. LittleFS
+// resolves "//" and "." segments, so any name not in canonical form counts as
+// protected too; catalog names always are.
+bool isProtectedFile(const char *name)
+{
+  size_t length = strlen(name);
+  if (name[0] != '/' || strstr(name, "//") || strstr(name, "/.") || strstr(name, "..") ||
+      (length > 1 && name[length - 1] == '/'))
+  {
+    return true;
+  }
+  return strcmp(name, NETWORK_FILE) == 0 || strcmp(name, NETWORK_TEMP_FILE) == 0 ||
+         strncmp(name, "/settings", 9) == 0 || strcmp(name, LOG_DIR) == 0 ||
+         strncmp(name, LOG_DIR "/", sizeof(LOG_DIR)) == 0;
+}
+
+// Catalog entries /api/files lists
+int listedFileCount()
+{
+  CatalogEntry entry;
+  int count = 0;
+  for (int i = 0; catalogEntry(i, entry); i++)
+  {
+    count += !isProtectedFile(entry.name);
+  }
+  return count;
+}
+
+// Catalog index of the listed file at 'position', the catalog size past the last
+int listedCatalogIndex(int position)
+{
+  CatalogEntry entry;
+  int i = 0;
+  for (; catalogEntry(i, entry); i++)
+  {
+    if (!isProtectedFile(entry.name) && position-- == 0)
+    {
+      break;
+    }
+  }
+  return i;
+}
+
+// Index of 'name' in the catalog, or of the slot it would be inserted at
+static int catalogLowerBound(const char *name)
+{
+  int low = 0, high = catalogCount;
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    if (strcmp(fileCatalog[mid].name, name) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+static void catalogStore(const char *name, uint32_t size, uint32_t modified, uint32_t dataFrom, uint32_t dataTo)
+{
+  if (strlen(name) >= CATALOG_NAME_MAX)
+  {
+    return;
+  }
+  bool full = false;
+
+  portENTER_CRITICAL(&catalogMux);
+  int pos = catalogLowerBound(name);
+  if (pos == catalogCount || strcmp(fileCatalog[pos].name, name) != 0)
+  {
+    if (catalogCount == CATALOG_MAX_FILES)
+    {
+      full = true;
+    }
+    else
+    {
+      memmove(&fileCatalog[pos + 1], &fileCatalog[pos], sizeof(CatalogEntry) * (catalogCount - pos));
+      strcpy(fileCatalog[pos].name, name);
+      catalogCount++;
+    }
+  }
+  if (!full)
+  {
+    CatalogEntry &entry = fileCatalog[pos];
+    entry.size = size;
+    entry.lastModified = modified;
+    entry.dataFrom = dataFrom;
+    entry.dataTo = dataTo;
+  }
+  portEXIT_CRITICAL(&catalogMux);
+
+  if (full)
+  {
+    logSerial("File catalog full, %s not listed", name);
+  }
+}
+
+// Add a file or refresh its entry after a write
+void catalogUpdate(const char *name, uint32_t size, uint32_t dataFrom, uint32_t dataTo)
+{
+  catalogStore(name, size, nowUnix(), dataFrom, dataTo);
+}
+
+void catalogRemove(const char *name)
+{
+  portENTER_CRITICAL(&catalogMux);
+  int pos = catalogLowerBound(name);
+  if (pos < catalogCount && strcmp(fileCatalog[pos].name, name) == 0)
+  {
+    catalogCount--;
+    memmove(&fileCatalog[pos], &fileCatalog[pos + 1], sizeof(CatalogEntry) * (catalogCount - pos));
+  }
+  portEXIT_CRITICAL(&catalogMux);
+}
+
+// Copy of entry 'index'; false past the end
+bool catalogEntry(int index, CatalogEntry &entry)
+{
+  portENTER_CRITICAL(&catalogMux);
+  bool found = index >= 0 && index < catalogCount;
+  if (found)
+  {
+    entry = fileCatalog[index];
+  }
+  portEXIT_CRITICAL(&catalogMux);
+  return found;
+}
+
+bool catalogFind(const char *name, CatalogEntry &entry)
+{
+  portENTER_CRITICAL(&catalogMux);
+  int pos = catalogLowerBound(name);
+  bool found = pos < catalogCount && strcmp(fileCatalog[pos].name, name) == 0;
+  if (found)
+  {
+    entry = fileCatalog[pos];
+  }
+  portEXIT_CRITICAL(&catalogMux);
+  return found;
+}
+
+int catalogSize()
+{
+  portENTER_CRITICAL(&catalogMux);
+  int count = catalogCount;
+  portEXIT_CRITICAL(&catalogMux);
+  return count;
+}
+
+// Time range of a legacy CSV from its first row; one file holds one day
+static void legacyDataRange(File &file, uint32_t &from, uint32_t &to)
+{
+  char row[24];
+  int length = file.read((uint8_t *)row, sizeof(row) - 1);
+  row[max(length, 0)] = '\0';
+
+  int year, month, day, hour, minute, second;
+  from = to = 0;
+  if (sscanf(row, "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) == 6)
+  {
+    from = DateTime(year, month, day, hour, minute, second).unixtime();
+    to = from - from % 86400 + 86399;
+  }
+}
+
+// Time range of log segment 'index'; a full segment ends where the next begins
+static void logSegmentRange(int index, uint32_t &from, uint32_t &to)
+{
+  from = logSegments[index].firstTimestamp;
+  to = 0;
+  if (from == LOG_EMPTY_TIMESTAMP)
+  {
+    from = 0;
+    return;
+  }
+
+  LogRecord newest;
+  if (index + 1 < logSegmentCount)
+  {
+    to = logSegments[index + 1].firstTimestamp - 1;
+  }
+  else if (readNewestLogRecord(newest))
+  {
+    to = newest.timestamp;
+  }
+}
+
+// Walk a directory into the catalog
+static void catalogDirectory(const char *path)
+{
+  File dir = LittleFS.open(path);
+  File file = dir.openNextFile();
+  char name[CATALOG_NAME_MAX];
+  unsigned id;
+
+  while (file)
+  {
+    if (!file.isDirectory())
+    {
+      const char *base = strrchr(file.name(), '/');
+      base = base ? base + 1 : file.name();
+      snprintf(name, sizeof(name), "%s/%s", strcmp(path, "/") == 0 ? "" : path, base);
+
+      uint32_t from = 0, to = 0;
+      if (isLegacyDataFile(name))
+      {
+        legacyDataRange(file, from, to);
+      }
+      else if (sscanf(base, "seg_%06u.bin", &id) == 1)
+      {
+        for (int i = 0; i < logSegmentCount; i++)
+        {
+          if (logSegments[i].id == id)
+            logSegmentRange(i, from, to);
+        }
+      }
+
+      catalogStore(name, file.size(), file.getLastWrite(), from, to);
+    }
+    file = dir.openNextFile();
+  }
+}
+
+// Boot: the one full walk of the filesystem (after the log index is loaded)
+void buildFileCatalog()
+{
+  unsigned long started = millis();
+  portENTER_CRITICAL(&catalogMux);
+  catalogCount = 0;
+  portEXIT_CRITICAL(&catalogMux);
+
+  catalogDirectory("/");
+  catalogDirectory(LOG_DIR);
+  logSerial("File catalog: %d files in %lu ms", catalogSize(), millis() - started);
+}
+
+// Format catalog entries into the next block of /api/files
+static bool refillFileList(FileListStream &stream)
+{
+  stream.offset = 0;
+  stream.length = 0;
+
+  switch (stream.stage)
+  {
+  case 1:
+  {
+    CatalogEntry entry;
+    while (stream.next < stream.end && sizeof(stream.buffer) - stream.length >= FILE_LIST_ROW_MAX &&
+           catalogEntry(stream.next, entry))
+    {
+      if (isProtectedFile(entry.name))
+      {
+        stream.next++;
+        continue;
+      }
+      stream.length += snprintf(stream.buffer + stream.length, sizeof(stream.buffer) - stream.length,
+                                "%s{\"name\":\"%s\",\"size\":%u,\"lastModified\":%u,\"from\":%u,\"to\":%u}",
+                                stream.next > stream.first ? "," : "",
+                                entry.name, (unsigned)entry.size, (unsigned)entry.lastModified,
+                                (unsigned)entry.dataFrom, (unsigned)entry.dataTo);
+      stream.next++;
+    }
+    if (stream.length == 0)
+    {
+      stream.stage = 2;
+      return refillFileList(stream);
+    }
+    return true;
+  }
+
+  case 2:
+    stream.length = snprintf(stream.buffer, sizeof(stream.buffer), "]}");
+    stream.stage = 3;
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// Chunked response filler for /api/files
+size_t fillFileList(FileListStream &stream, uint8_t *buffer, size_t maxLen)
+{
+  while (stream.offset == stream.length)
+  {
+    if (!refillFileList(stream))
+    {
+      return 0; // End of response
+    }
+  }
+
+  size_t n = min(maxLen, stream.length - stream.offset);
+  memcpy(buffer, stream.buffer + stream.offset, n);
+  stream.offset += n;
+  return n;
+}
+
+// Refuses the protected files: network.bin/.tmp, settings.bin/.tmp, the
+// settings_chN.bin channel files, settings.json and everything under /log/
+// (log segments are only removed through the log index, by range delete)
+bool deleteFile(String filename)
+{
+  if (!filename.startsWith("/"))
+  {
+    filename = "/" + filename;
+  }
+  if (isProtectedFile(filename.c_str()))
+  {
+    return false;
+  }
+
+  bool removed = LittleFS.remove(filename);
+  if (removed)
+  {
+    catalogRemove(filename.c_str());
+  }
+  return removed;
+}
+
+String getFileInfo(String filename)
+{
+  if (!filename.startsWith("/"))
+  {
+    filename = "/" + filename;
+  }
+
+  CatalogEntry entry;
+  if (!catalogFind(filename.c_str(), entry))
+  {
+    return "{}";
+  }
+
+  JsonDocument &doc = apiDocument();
+  doc["name"] = filename;
+  doc["size"] = entry.size;
+  doc["lastModified"] = entry.lastModified;
+  String result;
+  serializeJson(doc, result);
+  return result;
+}
+
+// MPU6050 data-ready interrupt: wake the sensor task
+void IRAM_ATTR onMpuDataReady()
+{
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR(sensorTaskHandle, &higherPriorityTaskWoken);
+  if (higherPriorityTaskWoken)
+  {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Write a single register of the probe being sampled (mpuAddress) on I2C Bus 1
+void mpuWriteRegister(uint8_t reg, uint8_t value)
+{
+  i2c1Lock();
+  I2C_1.beginTransmission(mpuAddress);
+  I2C_1.write(reg);
+  I2C_1.write(value);
+  recordI2cResult(I2C_1, I2C_1.endTransmission());
+  i2c1Unlock();
+}
+
+// Burst read consecutive registers of the probe being sampled on I2C Bus 1
+bool mpuReadRegisters(uint8_t reg, uint8_t *buffer, size_t length)
+{
+  bool ok = false;
+
+  i2c1Lock();
+  I2C_1.beginTransmission(mpuAddress);
+  I2C_1.write(reg);
+  uint8_t error = I2C_1.endTransmission(false);
+  if (error == 0)
+  {
+    // A short read means the device stopped answering mid-transfer
+    ok = I2C_1.requestFrom(mpuAddress, length) == length &&
+         I2C_1.readBytes(buffer, length) == length;
+    if (!ok)
+      error = 5;
+  }
+  recordI2cResult(I2C_1, error);
+  i2c1Unlock();
+
+  return ok;
+}
+
+// Bring up another channel's MPU6050 the way mpu.begin() and the range
+// settings in initializeSystem() do for channel 0 (before the sensor task runs)
+bool initProbe(uint8_t address)
+{
+  mpuAddress = address;
+  uint8_t id = 0;
+  bool found = mpuReadRegisters(MPU_REG_WHO_AM_I, &id, 1) && id == 0x68; // AD0 doesn't change WHO_AM_I
+  if (found)
+  {
+    mpuWriteRegister(MPU_REG_PWR_MGMT_1, 0x80); // Device reset
+    delay(100);
+    mpuWriteRegister(MPU_REG_PWR_MGMT_1, 0x01);   // Awake, PLL with X gyro reference
+    mpuWriteRegister(MPU_REG_CONFIG, 0x04);       // DLPF 21 Hz
+    mpuWriteRegister(MPU_REG_GYRO_CONFIG, 0x08);  // +-500 deg/s
+    mpuWriteRegister(MPU_REG_ACCEL_CONFIG, MPU_ACCEL_RANGE << 3); // AFS_SEL, as for channel 0
+  }
+  mpuAddress = probeHardware[0].mpuAddress;
+  return found;
+}
+
+// I2C_1 arbiter. The mutex is priority-inheriting and only held for one
+// transaction, so the sensor task waits at most one OLED chunk.
+void i2c1Lock()
+{
+  if (i2c1Mutex)
+    xSemaphoreTake(i2c1Mutex, portMAX_DELAY);
+}
+
+void i2c1Unlock()
+{
+  if (i2c1Mutex)
+    xSemaphoreGive(i2c1Mutex);
+}
+
+// Consistent copy of one bus's counters for the web handlers
+I2cBusStats readI2cStats(int index)
+{
+  if (index == 0)
+    i2c1Lock();
+  else
+    i2c2Lock();
+  I2cBusStats stats = i2cStats[index];
+  if (index == 0)
+    i2c1Unlock();
+  else
+    i2c2Unlock();
+  return stats;
+}
+
+// I2C_2 arbiter, held per transaction like i2c1Lock()
+void i2c2Lock()
+{
+  if (i2c2Mutex)
+    xSemaphoreTake(i2c2Mutex, portMAX_DELAY);
+}
+
+void i2c2Unlock()
+{
+  if (i2c2Mutex)
+    xSemaphoreGive(i2c2Mutex);
+}
+
+// Count the result of an endTransmission()-style status (0 ok, 2/3 NACK,
+// 4 bus error, 5 timeout). Too many errors in one window halve the clock,
+// down to I2C_MIN_CLOCK_HZ. The caller holds the bus lock, which guards the
+// bus's stats and its clock.
+void recordI2cResult(TwoWire &bus, uint8_t error)
+{
+  I2cBusStats &stats = i2cStats[&bus == &I2C_1 ? 0 : 1];
+
+  stats.transactions++;
+  stats.windowTransactions++;
+  if (error == 2 || error == 3)
+  {
+    stats.nacks++;
+    stats.windowErrors++;
+  }
+  else if (error != 0)
+  {
+    stats.timeouts++;
+    stats.windowErrors++;
+  }
+
+  if (stats.windowErrors >= I2C_ERROR_THRESHOLD && stats.clockHz > I2C_MIN_CLOCK_HZ)
+  {
+    stats.clockHz = max((uint32_t)I2C_MIN_CLOCK_HZ, stats.clockHz / 2);
+    stats.stepDowns++;
+    bus.setClock(stats.clockHz);
+    logSerial("I2C bus %d: %u errors, clock lowered to %u Hz", &bus == &I2C_1 ? 1 : 2,
+              (unsigned)stats.windowErrors, (unsigned)stats.clockHz);
+    stats.windowTransactions = 0;
+    stats.windowErrors = 0;
+  }
+  else if (stats.windowTransactions >= I2C_ERROR_WINDOW)
+  {
+    stats.windowTransactions = 0;
+    stats.windowErrors = 0;
+  }
+}
+
+// Apply probe choice, sample rate and acquisition mode to the MPU6050 (sensor task only)
+void configureAcquisition()
+{
+  uint8_t probe = requestedProbe.load();
+  if (probeHardware[probe].mpuAddress != mpuAddress)
+  {
+    // Quiet the probe being left: no FIFO filling up, no data-ready pulses
+    mpuWriteRegister(MPU_REG_INT_ENABLE, 0x00);
+    mpuWriteRegister(MPU_REG_FIFO_EN, 0x00);
+    mpuWriteRegister(MPU_REG_USER_CTRL, 0x00);
+    mpuAddress = probeHardware[probe].mpuAddress;
+  }
+
+  uint32_t settings = channelAcquisition[probe].load(std::memory_order_acquire);
+  mpuDataReadySeen = false; // Each probe has its own INT line
+  sampledRateHz = achievableSampleRate(settings >> 8);
+  sampledMode = (settings & 0xFF) == ACQ_FIFO ? ACQ_FIFO : ACQ_DATA_READY;
+  lastSampleUs = 0;
+
+  // With the DLPF enabled the internal sample clock is 1 kHz: rate = 1000 / (1 + divisor)
+  mpuWriteRegister(MPU_REG_SMPLRT_DIV, (uint8_t)(1000 / sampledRateHz - 1));
+
+  if (sampledMode == ACQ_FIFO)
+  {
+    mpuWriteRegister(MPU_REG_INT_ENABLE, 0x00);
+    mpuWriteRegister(MPU_REG_USER_CTRL, 0x04); // FIFO_RESET
+    mpuWriteRegister(MPU_REG_FIFO_EN, 0x08);   // ACCEL_FIFO_EN only
+    mpuWriteRegister(MPU_REG_USER_CTRL, 0x40); // FIFO_EN
+  }
+  else
+  {
+    mpuWriteRegister(MPU_REG_USER_CTRL, 0x00);
+    mpuWriteRegister(MPU_REG_FIFO_EN, 0x00);
+    mpuWriteRegister(MPU_REG_INT_ENABLE, 0x01); // DATA_RDY_EN
+  }
+
+  // Samples pushed from here on come from 'probe'
+  sampledProbe.store(probe, std::memory_order_release);
+}
+
+// Hand a channel's sampling settings to the sensor task (control loop only).
+// Takes effect on the next configureAcquisition(); set acquisitionReconfigure.
+void publishAcquisition(int channel, const Config &settings)
+{
+  channelAcquisition[channel].store(((uint32_t)settings.sampleRateHz << 8) | (uint8_t)settings.acquisitionMode,
+                                    std::memory_order_release);
+}
+
+// Nearest rate the 1 kHz sample clock divides down to exactly, e.g. 300 Hz
+// runs at 333 Hz. Settings store this rate, so timestamps, the jitter metric
+// and capture headers all use the one the MPU6050 actually runs at.
+int achievableSampleRate(int hz)
+{
+  hz = constrain(hz, MIN_SAMPLE_RATE_HZ, MAX_SAMPLE_RATE_HZ);
+  return 1000 / (1000 / hz);
+}
+
+// Queue one raw sample for the control loop. Returns false if the ring is full.
+bool pushSample(uint32_t timestampUs, const uint8_t *raw)
+{
+  uint32_t head = sampleHead.load(std::memory_order_relaxed);
+  if (head - sampleTail.load(std::memory_order_acquire) >= SAMPLE_RING_SIZE)
+  {
+    // Consumer fell behind, drop the newest sample
+    sampleOverruns++;
+    return false;
+  }
+
+  // Deviation from the configured period; FIFO bursts show up as drain latency
+  if (lastSampleUs != 0)
+  {
+    int32_t deviation = (int32_t)(timestampUs - lastSampleUs) - (int32_t)(1000000UL / sampledRateHz);
+    recordMetric(METRIC_SAMPLE_JITTER, abs(deviation));
+  }
+  lastSampleUs = timestampUs;
+
+  // Registers are big-endian X, Y, Z
+  AccelSample &slot = sampleRing[head & (SAMPLE_RING_SIZE - 1)];
+  slot.timestampUs = timestampUs;
+  slot.x = (int16_t)((raw[0] << 8) | raw[1]);
+  slot.y = (int16_t)((raw[2] << 8) | raw[3]);
+  slot.z = (int16_t)((raw[4] << 8) | raw[5]);
+  sampleHead.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+// Read every complete sample currently in the MPU6050 FIFO
+void drainMpuFifo()
+{
+  uint8_t countBytes[2];
+  if (!mpuReadRegisters(MPU_REG_FIFO_COUNT_H, countBytes, 2))
+  {
+    return;
+  }
+
+  uint16_t fifoCount = (countBytes[0] << 8) | countBytes[1];
+  uint8_t intStatus = 0;
+  mpuReadRegisters(MPU_REG_INT_STATUS, &intStatus, 1);
+  if ((intStatus & 0x10) || fifoCount >= 1024)
+  {
+    // FIFO_OFLOW: contents are no longer frame aligned, start over
+    mpuWriteRegister(MPU_REG_USER_CTRL, 0x44); // FIFO_EN | FIFO_RESET
+    sampleOverruns++;
+    return;
+  }
+
+  uint16_t samples = fifoCount / 6;
+  uint32_t periodUs = 1000000UL / sampledRateHz;
+  uint32_t now = micros();
+  uint8_t burst[FIFO_BURST_BYTES];
+
+  // Frames are oldest first; back-date them from the drain time
+  for (uint16_t done = 0; done < samples;)
+  {
+    uint16_t chunk = min((uint16_t)(samples - done), (uint16_t)(FIFO_BURST_BYTES / 6));
+    if (!mpuReadRegisters(MPU_REG_FIFO_R_W, burst, chunk * 6))
+    {
+      return;
+    }
+    for (uint16_t i = 0; i < chunk; i++, done++)
+    {
+      pushSample(now - (samples - 1 - done) * periodUs, &burst[i * 6]);
+    }
+  }
+}
+
+// Sensor acquisition task. In ACQ_DATA_READY mode it reads the MPU6050 on every
+// data-ready interrupt; if the INT line is not wired the notify wait times out and
+// the task paces itself. In ACQ_FIFO mode it drains the hardware FIFO periodically.
+void sensorTask(void *param)
+{
+  configureAcquisition();
+
+  for (;;)
+  {
+    if (acquisitionReconfigure)
+    {
+      acquisitionReconfigure = false;
+      configureAcquisition();
+    }
+
+    if (sampledMode == ACQ_FIFO)
+    {
+      vTaskDelay(pdMS_TO_TICKS(FIFO_DRAIN_INTERVAL_MS));
+      drainMpuFifo();
+      continue;
+    }
+
+    TickType_t timeout = pdMS_TO_TICKS(1000 / sampledRateHz + 2);
+    if (ulTaskNotifyTake(pdTRUE, timeout) > 0)
+    {
+      mpuDataReadySeen = true;
+    }
+
+    uint8_t raw[6];
+    if (mpuReadRegisters(MPU_REG_ACCEL_XOUT_H, raw, sizeof(raw)))
+    {
+      pushSample(micros(), raw);
+    }
+  }
+}
+
+void startSensorTask()
+{
+  xTaskCreatePinnedToCore(sensorTask, "sensor", SENSOR_TASK_STACK, NULL,
+                          SENSOR_TASK_PRIORITY, &sensorTaskHandle, SENSOR_TASK_CORE);
+
+  // Only the probe being sampled has its data-ready interrupt enabled
+  for (int channel = 0; channel < PROBE_CHANNELS; channel++)
+  {
+    if (channelPresent[channel])
+    {
+      pinMode(probeHardware[channel].intPin, INPUT);
+      attachInterrupt(digitalPinToInterrupt(probeHardware[channel].intPin), onMpuDataReady, RISING);
+    }
+  }
+
+  logSerial("Sensor task started at %d Hz on core %d (%s)", config.sampleRateHz, SENSOR_TASK_CORE,
+            config.acquisitionMode == ACQ_FIFO ? "FIFO" : "data ready");
+}
+
+// Take the oldest sample from the ring buffer (control loop only)
+bool popSample(AccelSample &sample)
+{
+  uint32_t tail = sampleTail.load(std::memory_order_relaxed);
+  if (tail == sampleHead.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+
+  sample = sampleRing[tail & (SAMPLE_RING_SIZE - 1)];
+  sampleTail.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+// Drop everything buffered so far (samples outside MEASURING are not needed)
+void discardSamples()
+{
+  uint32_t head = sampleHead.load(std::memory_order_acquire);
+  if (head != sampleTail.load(std::memory_order_relaxed) && sampledProbe.load() == activeChannel)
+  {
+    // Keep the newest angle for live readouts
+    liveAngle = sampleAngle(sampleRing[(head - 1) & (SAMPLE_RING_SIZE - 1)]);
+  }
+  sampleTail.store(head, std::memory_order_release);
+}
+
+// Replace the blocking performMeasurement() function with this non-blocking version
+// 'replicates' > 1 runs a series: the chamber is exchanged between readings
+// without the full drain, and an aggregate record closes the series
+void performMeasurement(int replicates)
+{
+  if (measurementState == IDLE)
+  {
+    // Start the measurement sequence
+    measurementState = EMPTYING_INITIAL;
+    stateStartTime = millis();
+    isMeasuring = true;
+
+    seriesTarget = constrain(replicates, 1, SERIES_MAX_REPLICATES);
+    seriesIndex = 0;
+    seriesCount = 0;
+    seriesDensityMean = 0.0;
+    seriesAngleMean = 0.0;
+    seriesAngleM2 = 0.0;
+    seriesSamples = 0;
+    seriesFlags = 0;
+    beginReplicate();
+
+    // Ensure empty solenoid is closed
+    digitalWrite(emptyValve->pin, HIGH);
+
+    if (seriesTarget > 1)
+      logSerial("Starting measurement series of %d replicates...", seriesTarget);
+    else
+      logSerial("Starting measurement sequence...");
+  }
+}
+
+// Reset the per-reading measurement variables
+void beginReplicate()
+{
+  reading.reset();
+  measurementFlags = 0;
+  lastAngleReadTime = 0;
+}
+
+void enterSettling(unsigned long now)
+{
+  if (seriesIndex == 0)
+  {
+    startCapture(); // An armed capture records the first replicate
+  }
+  measurementState = WAITING_TO_SETTLE;
+  stateStartTime = now;
+  settleWindow.reset();
+  settleWindowStart = now;
+  settlePreviousMean = NAN;
+  settleStableSeconds = 0;
+  logSerial("Waiting for settling...");
+}
+
+// Fold one replicate into the series statistics
+void addSeriesResult(float density, float angle, uint32_t samples, uint16_t flags)
+{
+  seriesCount++;
+  seriesDensityMean += (density - seriesDensityMean) / seriesCount;
+  double delta = angle - seriesAngleMean;
+  seriesAngleMean += delta / seriesCount;
+  seriesAngleM2 += delta * (angle - seriesAngleMean);
+  seriesSamples += samples;
+  seriesFlags |= flags;
+}
+
+// Publish and log the aggregate of a finished series
+void finishSeries()
+{
+  if (seriesCount == 0)
+  {
+    logSerial("Series finished without a valid replicate");
+    return;
+  }
+
+  float angleStdDev = seriesCount > 1 ? sqrt(seriesAngleM2 / (seriesCount - 1)) : 0.0f;
+  currentDensity = seriesDensityMean;
+  currentAngle = seriesAngleMean;
+  lastMeasurement = currentDensity;
+  lastMeasurementTime = nowDateTime();
+  lastMeasurementStdDev = angleStdDev;
+  lastMeasurementSamples = seriesSamples;
+
+  config.lastMeasurementValue = currentDensity;
+  config.lastMeasurementAngle = currentAngle;
+  config.lastMeasurementTime = lastMeasurementTime.unixtime();
+  markMeasurementStateDirty();
+
+  logSerial("Series completed - %d/%d replicates, Density: %.4f, Angle: %.2f°, Replicate StdDev: %.3f°",
+            seriesCount, seriesTarget, currentDensity, currentAngle, angleStdDev);
+  saveMeasurementData(currentDensity, currentAngle, angleStdDev, seriesSamples,
+                      (seriesFlags & ~LOG_FLAG_REPLICATE) | LOG_FLAG_SERIES, lastMeasurementTime, seriesCount);
+}
+
+// Add this function to handle the measurement state machine
+void updateMeasurementState()
+{
+  if (measurementState == IDLE)
+  {
+    return;
+  }
+
+  unsigned long currentTime = millis();
+  unsigned long elapsedTime = currentTime - stateStartTime;
+
+  switch (measurementState)
+  {
+  case EMPTYING_INITIAL:
+    if (elapsedTime >= 1000)
+    { // 1 second delay
+      // Step 2: Fill chamber, closed again by the valve timer
+      openValveFor(*fillValve, config.fillDurationMs);
+      measurementState = FILLING;
+      stateStartTime = currentTime;
+      logSerial("Filling chamber...");
+    }
+    break;
+
+  case FILLING:
+    if (fillValve->closed && claimSensor())
+    {
+      logSerial("Fill valve open for %lu ms", (unsigned long)((fillValve->closedUs - fillValve->openedUs) / 1000));
+      enterSettling(currentTime);
+    }
+    break;
+
+  case EXCHANGING:
+    if (fillValve->closed && emptyValve->closed && claimSensor())
+    {
+      logSerial("Sample exchanged, fill valve open for %lu ms",
+                (unsigned long)((fillValve->closedUs - fillValve->openedUs) / 1000));
+      enterSettling(currentTime);
+    }
+    break;
+
+  case WAITING_TO_SETTLE:
+  {
+    if (sensorSwitching)
+    {
+      // Until the sensor task has moved to this probe the ring holds the last one's samples
+      bool switched = sampledProbe.load(std::memory_order_acquire) == activeChannel;
+      discardSamples();
+      if (!switched)
+      {
+        break;
+      }
+      sensorSwitching = false;
+      sampleOverruns = 0;
+    }
+
+    AccelSample sample;
+    while (popSample(sample))
+    {
+      captureSample(sample);
+      liveAngle = sampleAngle(sample);
+      settleWindow.add(liveAngle);
+    }
+
+    // A second is stable when both its noise and its drift from the previous
+    // second are below settleThreshold
+    if (config.settleStableSeconds > 0 && currentTime - settleWindowStart >= 1000)
+    {
+      bool stable = settleWindow.count > 1 &&
+                    settleWindow.stddev() < config.settleThreshold &&
+                    !isnan(settlePreviousMean) &&
+                    fabs(settleWindow.mean - settlePreviousMean) < config.settleThreshold;
+
+      settleStableSeconds = stable ? settleStableSeconds + 1 : 0;
+      settlePreviousMean = settleWindow.count > 0 ? settleWindow.mean : NAN;
+      settleWindow.reset();
+      settleWindowStart = currentTime;
+    }
+
+    // waitDuration is the upper bound; a stable probe may start measuring sooner
+    bool settled = config.settleStableSeconds > 0 && settleStableSeconds >= config.settleStableSeconds;
+    if (settled || elapsedTime >= (config.waitDuration * 1000))
+    {
+      if (settled)
+      {
+        logSerial("Probe settled after %lus", elapsedTime / 1000);
+      }
+      else if (config.settleStableSeconds > 0)
+      {
+        measurementFlags |= LOG_FLAG_SETTLE_TIMEOUT;
+        logSerial("Settle timeout reached, measuring anyway");
+      }
+
+      measurementState = MEASURING;
+      stateStartTime = currentTime;
+      lastAngleReadTime = currentTime;
+      sampleOverruns = 0; // LOG_FLAG_SAMPLES_DROPPED covers the measurement window only
+      markCaptureMeasureStart();
+      logSerial("Starting angle measurements...");
+    }
+    break;
+  }
+
+  case MEASURING:
+  {
+    // Consume everything the sensor task has buffered since the last pass
+    AccelSample sample;
+    while (popSample(sample))
+    {
+      captureSample(sample);
+      liveAngle = reading.add(sample);
+    }
+
+    // Stop early once the mean is known precisely enough
+    bool converged = reading.converged(config.convergenceThreshold);
+
+    if (!converged && elapsedTime < (config.measurementDuration * 1000))
+    {
+      // Progress log once per second
+      if (currentTime - lastAngleReadTime >= 1000)
+      {
+        lastAngleReadTime = currentTime;
+        logSerial("Measuring %lu/%ds - Samples: %u/%u, Avg angle: %.2f°, SE: %.3f°",
+                  elapsedTime / 1000, config.measurementDuration,
+                  (unsigned)reading.estimator.count, (unsigned)reading.total,
+                  reading.estimator.mean, reading.estimator.standardError());
+      }
+    }
+    else
+    {
+      if (converged)
+      {
+        measurementFlags |= LOG_FLAG_CONVERGED;
+        logSerial("Converged after %lu ms", elapsedTime);
+      }
+      if (sampleOverruns > 0)
+      {
+        measurementFlags |= LOG_FLAG_SAMPLES_DROPPED;
+      }
+
+      // Measurement complete, process results
+      stopCapture();
+      if (reading.estimator.count > 0)
+      {
+        // One atan2 of the averaged vector; the curve maps that raw angle and
+        // the offset only adjusts the reported angle
+        float meanAngle = reading.meanAngle();
+        currentAngle = meanAngle + config.calibrationOffset;
+        currentDensity = angleToDensity(meanAngle);
+        lastMeasurement = currentDensity;
+        lastMeasurementTime = nowDateTime();
+        lastMeasurementStdDev = reading.estimator.stddev();
+        lastMeasurementSamples = reading.estimator.count;
+
+        // Update config with new measurement data including angle
+        config.lastMeasurementValue = currentDensity;
+        config.lastMeasurementAngle = currentAngle;
+        config.lastMeasurementTime = lastMeasurementTime.unixtime();
+        markMeasurementStateDirty(); // Committed to NVS later, coalesced
+
+        // Log measurement details
+        logSerial("Measurement completed - Angle: %.2f°, StdDev: %.3f°, Density: %.4f, "
+                  "Valid readings: %u/%u (%u outliers)",
+                  currentAngle, lastMeasurementStdDev, currentDensity,
+                  (unsigned)reading.estimator.count, (unsigned)reading.total, (unsigned)reading.estimator.rejected);
+
+        // Save measurement data including angle and spread
+        if (seriesTarget > 1)
+        {
+          measurementFlags |= LOG_FLAG_REPLICATE;
+          addSeriesResult(currentDensity, currentAngle, lastMeasurementSamples, measurementFlags);
+        }
+        saveMeasurementData(currentDensity, currentAngle, lastMeasurementStdDev,
+                            lastMeasurementSamples, measurementFlags, lastMeasurementTime);
+      }
+      else
+      {
+        logSerial("No valid readings obtained during measurement");
+      }
+
+      if (sampleOverruns > 0)
+      {
+        logSerial("Warning: %u samples dropped (ring buffer full)", (unsigned)sampleOverruns);
+        sampleOverruns = 0;
+      }
+
+      if (seriesIndex + 1 < seriesTarget)
+      {
+        // Next replicate: drain with the fill valve already open, then top up.
+        // Replaces the full drain, the pre-empty delay and the separate fill.
+        seriesIndex++;
+        beginReplicate();
+        openValveFor(*emptyValve, config.seriesFlushMs);
+        openValveFor(*fillValve, config.seriesFlushMs + config.fillDurationMs);
+        measurementState = EXCHANGING;
+        stateStartTime = currentTime;
+        logSerial("Exchanging sample for replicate %d/%d...", seriesIndex + 1, seriesTarget);
+        break;
+      }
+
+      if (seriesTarget > 1)
+      {
+        finishSeries();
+      }
+
+      // Move to emptying phase
+      openValveFor(*emptyValve, config.emptyDurationMs);
+      measurementState = EMPTYING_FINAL;
+      stateStartTime = currentTime;
+      logSerial("Emptying chamber...");
+    }
+    break;
+  }
+
+  case EMPTYING_FINAL:
+    if (emptyValve->closed)
+    {
+
+      // Calculate next measurement time based on current measurement
+      DateTime now = nowDateTime();
+      // Convert minutes to seconds: config.measurementInterval * 60
+      nextMeasurementTime = DateTime((uint32_t)(now.unixtime() + (config.measurementInterval * 60)));
+
+      // Reset state
+      measurementState = IDLE;
+      isMeasuring = false;
+      seriesTarget = 1;
+      seriesIndex = 0;
+
+      logSerial("Measurement sequence complete");
+      logSerial("Next measurement scheduled for: %04d-%02d-%02dT%02d:%02d:%02d", nextMeasurementTime.year(),
+                nextMeasurementTime.month(), nextMeasurementTime.day(), nextMeasurementTime.hour(),
+                nextMeasurementTime.minute(), nextMeasurementTime.second());
+    }
+    break;
+  }
+}
+
+// esp_timer task context: close the valve exactly when its time is up
+void onValveTimer(void *arg)
+{
+  ValveTimer *valve = (ValveTimer *)arg;
+  digitalWrite(valve->pin, HIGH);
+  valve->closedUs = esp_timer_get_time();
+  valve->closed = true;
+
+  int32_t error = (int32_t)(valve->closedUs - valve->openedUs - (int64_t)valve->durationUs);
+  valve->errorUs = error;
+  if (abs(error) > abs(valve->maxErrorUs))
+    valve->maxErrorUs = error;
+  valve->runs++;
+}
+
+void initValveTimers()
+{
+  for (int ch = 0; ch < PROBE_CHANNELS; ch++)
+  {
+    for (int i = 0; i < 2; i++)
+    {
+      ValveTimer *valve = &channelValves[ch][i];
+      memset(valve, 0, sizeof(*valve));
+      valve->pin = i ? probeHardware[ch].emptyPin : probeHardware[ch].fillPin;
+      valve->closed = true;
+
+      esp_timer_create_args_t args = {};
+      args.callback = onValveTimer;
+      args.arg = valve;
+      args.dispatch_method = ESP_TIMER_TASK;
+      args.name = i ? "empty" : "fill";
+      esp_timer_create(&args, &valve->timer);
+    }
+  }
+}
+
+// Open a solenoid (active LOW) and schedule its close 'durationMs' later
+void openValveFor(ValveTimer &valve, uint32_t durationMs)
+{
+  esp_timer_stop(valve.timer); // Not running is fine
+  valve.closed = false;
+  valve.durationUs = (uint64_t)max(durationMs, (uint32_t)1) * 1000;
+  valve.openedUs = esp_timer_get_time();
+  digitalWrite(valve.pin, LOW);
+  esp_timer_start_once(valve.timer, valve.durationUs);
+}
+
+// Stop a timed run early; the state machine sees the valve as closed
+void cancelValve(ValveTimer &valve)
+{
+  if (valve.closed)
+  {
+    return;
+  }
+  esp_timer_stop(valve.timer);
+  digitalWrite(valve.pin, HIGH);
+  valve.closedUs = esp_timer_get_time();
+  valve.closed = true;
+}
+
+// Control loop: arm a capture of the next measurement cycle, or cancel one
+void armCapture(bool enable)
+{
+  uint8_t state = captureState.load();
+  if (!enable)
+  {
+    if (state == CAPTURE_RUNNING)
+    {
+      stopCapture();
+    }
+    else if (state == CAPTURE_PREPARING || state == CAPTURE_ARMED)
+    {
+      captureState = CAPTURE_OFF;
+      logSerial("Capture disarmed");
+    }
+    return;
+  }
+
+  if (state != CAPTURE_OFF && state != CAPTURE_DONE)
+  {
+    logSerial("Capture already armed");
+    return;
+  }
+  if (!captureBlocks)
+  {
+    captureBlocks = new (std::nothrow) CaptureBlock[2];
+    if (!captureBlocks)
+    {
+      logSerial("Capture: out of memory");
+      return;
+    }
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    captureBlocks[i].count = 0;
+    captureBlocks[i].full.store(false);
+  }
+
+  captureState = CAPTURE_PREPARING;
+  xTaskNotifyGive(captureTaskHandle);
+}
+
+// Control loop, entering WAITING_TO_SETTLE: start an armed capture
+void startCapture()
+{
+  if (captureState.load() != CAPTURE_ARMED)
+  {
+    return;
+  }
+
+  memset(&captureHeader, 0, sizeof(captureHeader));
+  captureHeader.magic = TRACE_MAGIC;
+  captureHeader.version = TRACE_VERSION;
+  captureHeader.headerSize = sizeof(TraceHeader);
+  captureHeader.startTime = nowUnix();
+  captureHeader.channel = activeChannel;
+  captureHeader.sampleRateHz = config.sampleRateHz;
+  captureHeader.accelRangeG = MPU_ACCEL_RANGE_G; // Set in initializeSystem() and initProbe()
+  captureHeader.acquisitionMode = config.acquisitionMode;
+  captureHeader.capacity = captureCapacity.load();
+  captureHeader.measureStart = CAPTURE_NOT_REACHED;
+  captureHeader.measureEnd = CAPTURE_NOT_REACHED;
+  captureHeader.fillDurationMs = config.fillDurationMs;
+  captureHeader.waitDuration = config.waitDuration;
+  captureHeader.measurementDuration = config.measurementDuration;
+  captureHeader.settleStableSeconds = config.settleStableSeconds;
+  captureHeader.settleThreshold = config.settleThreshold;
+  captureHeader.convergenceThreshold = config.convergenceThreshold;
+  captureHeader.calibrationOffset = config.calibrationOffset;
+  captureHeader.calibrationScale = config.calibrationScale;
+
+  captureFillBlock = 0;
+  captureQueued = 0;
+  captureDropped = 0;
+  captureState = CAPTURE_RUNNING;
+  logSerial("Capture started (%u samples max)", (unsigned)captureHeader.capacity);
+}
+
+// Give the current block to the capture task and switch to the other one
+static void handOffCaptureBlock()
+{
+  captureBlocks[captureFillBlock].full.store(true, std::memory_order_release);
+  captureFillBlock ^= 1;
+  xTaskNotifyGive(captureTaskHandle);
+}
+
+// Control loop: copy one sample into the double buffer, never waits
+void captureSample(const AccelSample &sample)
+{
+  if (captureState.load(std::memory_order_relaxed) != CAPTURE_RUNNING)
+  {
+    return;
+  }
+
+  CaptureBlock &block = captureBlocks[captureFillBlock];
+  if (block.full.load(std::memory_order_acquire))
+  {
+    captureDropped++; // Both halves waiting for flash
+    return;
+  }
+
+  TraceSample &slot = block.samples[block.count++];
+  slot.timestampUs = sample.timestampUs;
+  slot.x = sample.x;
+  slot.y = sample.y;
+  slot.z = sample.z;
+  captureQueued++;
+
+  if (captureQueued >= captureHeader.capacity)
+  {
+    stopCapture(); // File full
+  }
+  else if (block.count == CAPTURE_BLOCK_SAMPLES)
+  {
+    handOffCaptureBlock();
+  }
+}
+
+void markCaptureMeasureStart()
+{
+  if (captureState.load() == CAPTURE_RUNNING)
+  {
+    captureHeader.measureStart = captureQueued;
+  }
+}
+
+// Control loop: end a running capture; the capture task finishes the file
+void stopCapture()
+{
+  if (captureState.load() != CAPTURE_RUNNING)
+  {
+    return;
+  }
+
+  if (measurementState == MEASURING)
+  {
+    captureHeader.measureEnd = captureQueued;
+  }
+  captureHeader.droppedSamples = captureDropped;
+  if (captureBlocks[captureFillBlock].count > 0 &&
+      !captureBlocks[captureFillBlock].full.load(std::memory_order_acquire))
+  {
+    handOffCaptureBlock();
+  }
+  captureState = CAPTURE_FINISHING;
+  xTaskNotifyGive(captureTaskHandle);
+  logSerial("Capture stopped: %u samples, %u dropped", (unsigned)captureQueued, (unsigned)captureDropped);
+}
+
+// Capture task: create an empty file and size the capture to the free space.
+// Blocks are appended from the start of the cycle, header first.
+static File prepareCaptureFile()
+{
+  size_t available = LittleFS.totalBytes() - LittleFS.usedBytes();
+  if (LittleFS.exists(CAPTURE_FILE))
+  {
+    available += LittleFS.open(CAPTURE_FILE, "r").size(); // Replaced below
+    LittleFS.remove(CAPTURE_FILE);
+    catalogRemove(CAPTURE_FILE);
+  }
+  uint32_t capacity = 0;
+  if (available > CAPTURE_FS_RESERVE + sizeof(TraceHeader))
+  {
+    capacity = min((size_t)CAPTURE_MAX_SAMPLES, (available - CAPTURE_FS_RESERVE - sizeof(TraceHeader)) / sizeof(TraceSample));
+  }
+  if (capacity < CAPTURE_BLOCK_SAMPLES)
+  {
+    logSerial("Capture: not enough flash space");
+    return File();
+  }
+
+  File file = LittleFS.open(CAPTURE_FILE, "w");
+  if (!file)
+  {
+    logSerial("Capture: cannot create %s", CAPTURE_FILE);
+    return file;
+  }
+
+  captureCapacity = capacity;
+  return file;
+}
+
+// Capture task: append every full block, oldest first. The file is only
+// flushed every CAPTURE_SYNC_BYTES for /api/capture/data.
+static void writeCaptureBlocks(File &file, int &writeBlock)
+{
+  while (captureBlocks[writeBlock].full.load(std::memory_order_acquire))
+  {
+    CaptureBlock &block = captureBlocks[writeBlock];
+    uint32_t written = captureWritten.load();
+    if (file)
+    {
+      if (written == 0)
+      {
+        // Header of this capture first (sampleCount 0), so a live download can parse the stream
+        file.write((const uint8_t *)&captureHeader, sizeof(captureHeader));
+      }
+      file.write((const uint8_t *)block.samples, block.count * sizeof(TraceSample));
+    }
+    written += block.count;
+    captureWritten = written;
+    if (file && (written - captureSynced.load()) * sizeof(TraceSample) >= CAPTURE_SYNC_BYTES)
+    {
+      file.flush();
+      captureSynced = written;
+    }
+
+    block.count = 0;
+    block.full.store(false, std::memory_order_release);
+    writeBlock ^= 1;
+  }
+}
+
+void captureTask(void *param)
+{
+  File file;
+  int writeBlock = 0;
+
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (captureState.load() == CAPTURE_PREPARING)
+    {
+      if (file)
+        file.close();
+      writeBlock = 0;
+      captureWritten = 0;
+      captureSynced = 0;
+      file = prepareCaptureFile();
+
+      uint8_t expected = CAPTURE_PREPARING; // Unless it was disarmed meanwhile
+      if (!file)
+        captureState.compare_exchange_strong(expected, CAPTURE_OFF);
+      else if (captureState.compare_exchange_strong(expected, CAPTURE_ARMED))
+        logSerial("Capture armed for the next measurement cycle");
+      continue;
+    }
+
+    uint8_t state = captureState.load();
+    if (state != CAPTURE_RUNNING && state != CAPTURE_FINISHING)
+    {
+      continue;
+    }
+    writeCaptureBlocks(file, writeBlock);
+
+    if (state == CAPTURE_FINISHING)
+    {
+      writeCaptureBlocks(file, writeBlock); // Anything handed off while finishing
+      captureHeader.sampleCount = captureWritten.load();
+      if (file)
+      {
+        // The one in-place write: sampleCount and measureEnd into the header
+        if (captureHeader.sampleCount > 0)
+        {
+          file.seek(0);
+          file.write((const uint8_t *)&captureHeader, sizeof(captureHeader));
         }
-      } else {
-        server.send(404, "application/json", "{\"error\":\"file_not_found\"}");
+        file.close();
+        catalogUpdate(CAPTURE_FILE, captureHeader.sampleCount ? sizeof(TraceHeader) + captureHeader.sampleCount * sizeof(TraceSample) : 0);
+      }
+      captureSynced = captureHeader.sampleCount;
+      captureState = CAPTURE_DONE;
+      logSerial("Capture saved to %s (%u samples)", CAPTURE_FILE, (unsigned)captureHeader.sampleCount);
+    }
+  }
+}
+
+void startCaptureTask()
+{
+  xTaskCreatePinnedToCore(captureTask, "capture", CAPTURE_TASK_STACK, NULL,
+                          CAPTURE_TASK_PRIORITY, &captureTaskHandle, CAPTURE_TASK_CORE);
+}
+
+const char *captureStateName(uint8_t state)
+{
+  switch (state)
+  {
+  case CAPTURE_PREPARING:
+    return "PREPARING";
+  case CAPTURE_ARMED:
+    return "ARMED";
+  case CAPTURE_RUNNING:
+    return "RUNNING";
+  case CAPTURE_FINISHING:
+    return "FINISHING";
+  case CAPTURE_DONE:
+    return "DONE";
+  default:
+    return "OFF";
+  }
+}
+
+// POST /api/capture {"arm": true|false}, GET /api/capture for the status and
+// GET /api/capture/data for the file. The download follows a running capture
+// as blocks reach flash and ends when the capture does.
+void setupCaptureEndpoints()
+{
+  // Registered before /api/capture, which would also match this path
+  server.on("/api/capture/data", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    uint8_t state = captureState.load();
+    if (state != CAPTURE_RUNNING && state != CAPTURE_FINISHING && state != CAPTURE_DONE) {
+      request->send(404, "application/json", "{\"error\":\"no_capture\"}");
+      return;
+    }
+
+    AsyncWebServerResponse *response = request->beginChunkedResponse("application/octet-stream",
+        [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+        {
+      uint32_t written = captureSynced.load();
+      size_t available = written ? sizeof(TraceHeader) + written * sizeof(TraceSample) : 0;
+      if (index >= available)
+      {
+        uint8_t now = captureState.load();
+        return (now == CAPTURE_RUNNING || now == CAPTURE_FINISHING) ? RESPONSE_TRY_AGAIN : 0;
+      }
+
+      // Reopened per chunk so each read sees the last flush
+      File file = LittleFS.open(CAPTURE_FILE, "r");
+      if (!file || !file.seek(index))
+      {
+        return 0;
       }
+      size_t length = file.read(buffer, min(maxLen, available - index));
+      file.close();
+      return length; });
+    response->addHeader("Content-Disposition", "attachment; filename=\"capture.bin\"");
+    request->send(response); });
+
+  server.on("/api/capture", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    doc["state"] = captureStateName(captureState.load());
+    doc["samples"] = captureWritten.load();
+    doc["capacity"] = captureCapacity.load();
+    doc["dropped"] = captureDropped;
+    doc["file"] = CAPTURE_FILE;
+
+    sendJson(request, doc); });
+
+  server.on("/api/capture", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+    if (!doc.containsKey("arm")) {
+      request->send(400, "application/json", "{\"error\":\"missing_arm\"}");
+      return;
+    }
+
+    ControlCommand command;
+    command.type = CMD_CAPTURE;
+    command.state = doc["arm"];
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
     } else {
-      server.send(400, "application/json", "{\"error\":\"filename_required\"}");
-    } });
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } }, NULL, collectRequestBody);
+}
+
+// Update the controlRelays function to use the state machine
+void controlRelays()
+{
+  // Control measuring pilot lamp using single relay, shared by all channels
+  // LOW = Red light (NC), HIGH = Green light (NO)
+  if (anyChannelMeasuring())
+  {
+    digitalWrite(MEASURING_RELAY_PIN, HIGH); // Green light (NO)
+  }
+  else
+  {
+    digitalWrite(MEASURING_RELAY_PIN, LOW); // Red light (NC)
+  }
+}
+
+// Updated updateDisplays function with angle information
+void updateDisplays(const StatusSnapshot &status)
+{
+  DateTime now = nowDateTime();
+  DateTime nextMeasurementTime(status.nextMeasurementTime);
+
+  // Check if it's time to switch display pages (every 3 seconds)
+  if (millis() - lastDisplayUpdate >= 3000)
+  {
+    displayPage = (displayPage + 1) % 2; // Toggle between 0 and 1
+    lastDisplayUpdate = millis();
+  }
+
+  // Display 1: Target angle range and next measurement time (2 pages)
+  display1.clearDisplay();
+  display1.setTextSize(1);
+
+  if (displayPage == 0)
+  {
+    // Page 0: Target angle range
+    display1.setCursor(0, 0);
+    display1.println("TARGET ANGLE");
+    display1.setCursor(0, 16);
+    display1.setTextSize(2); // Larger text for the values
+    display1.printf("%.0f-%.0f°", status.config.targetAngleMin, status.config.targetAngleMax);
+  }
+  else
+  {
+    // Page 1: Next measurement time
+    display1.setCursor(0, 0);
+    if (nextMeasurementTime.unixtime() > 0)
+    {
+      display1.println("NEXT MEASUREMENT");
+      display1.setCursor(0, 16);
+      display1.printf("%02d:%02d %02d/%02d/%02d",
+                      nextMeasurementTime.hour(),
+                      nextMeasurementTime.minute(),
+                      nextMeasurementTime.day(),
+                      nextMeasurementTime.month(),
+                      nextMeasurementTime.year() % 100);
+    }
+    else
+    {
+      display1.println("NO SCHEDULED");
+      display1.setCursor(0, 16);
+      display1.println("MEASUREMENT");
+    }
+  }
+  pushDisplayChanges(display1, I2C_1, oledShadow1, i2c1Mutex);
+
+  // Display 2: Last measurement angle and current time (2 pages)
+  display2.clearDisplay();
+  display2.setTextSize(1);
+
+  if (displayPage == 0)
+  {
+    // Page 0: Last measurement angle
+    display2.setCursor(0, 0);
+    display2.println("LAST MEASUREMENT");
+    display2.setCursor(0, 16);
+    display2.setTextSize(2); // Larger text for the value
+    if (status.config.lastMeasurementAngle > 0)
+    {
+      display2.printf("%.1f°", status.config.lastMeasurementAngle);
+    }
+    else
+    {
+      display2.print("--°");
+    }
+  }
+  else
+  {
+    // Page 1: Current time and status
+    display2.setCursor(0, 0);
+    display2.println("CURRENT TIME");
+    display2.setCursor(0, 12);
+    display2.printf("%02d:%02d:%02d %02d/%02d",
+                    now.hour(),
+                    now.minute(),
+                    now.second(),
+                    now.day(),
+                    now.month());
+
+    // Show measurement status on second line
+    display2.setCursor(0, 20);
+    if (status.isMeasuring)
+    {
+      switch (status.measurementState)
+      {
+      case EMPTYING_INITIAL:
+        display2.print("PREPARING");
+        break;
+      case FILLING:
+        display2.print("FILLING");
+        break;
+      case WAITING_TO_SETTLE:
+        display2.print("SETTLING");
+        break;
+      case MEASURING:
+        display2.printf("MEAS %lu/%ds", (millis() - status.stateStartTime) / 1000, status.config.measurementDuration);
+        break;
+      case EMPTYING_FINAL:
+        display2.print("EMPTYING");
+        break;
+      case EXCHANGING:
+        display2.printf("NEXT %d/%d", status.seriesIndex + 1, status.seriesTarget);
+        break;
+      default:
+        display2.print("MEASURING");
+      }
+    }
+    else
+    {
+      display2.print("READY");
+    }
+  }
+  pushDisplayChanges(display2, I2C_2, oledShadow2, i2c2Mutex);
+}
+
+// Send the columns of each page that differ from the last frame sent.
+// 'busMutex' is taken per transaction so other devices can interleave.
+// Returns the number of pages transferred (0 when nothing changed).
+int pushDisplayChanges(Adafruit_SSD1306 &display, TwoWire &bus, OledShadow &shadow, SemaphoreHandle_t busMutex)
+{
+  const uint8_t *frame = display.getBuffer();
+  if (!frame)
+  {
+    return 0; // Panel never initialized
+  }
 
-  // Add new API endpoint for individual file operations (DELETE)
-  server.on("/api/file", HTTP_DELETE, []()
-            {
-    if (server.hasArg("name")) {
-      String filename = server.arg("name");
-      bool success = deleteFile(filename);
-      
-      DynamicJsonDocument doc(256);
-      doc["success"] = success;
-      doc["message"] = success ? "File deleted successfully" : "Failed to delete file";
-      
-      String response;
-      serializeJson(doc, response);
-      server.send(success ? 200 : 400, "application/json", response);
-    } else {
-      server.send(400, "application/json", "{\"error\":\"filename_required\"}");
-    } });
+  int sent = 0;
+  for (int page = 0; page < OLED_PAGES; page++)
+  {
+    const uint8_t *row = frame + page * SCREEN_WIDTH;
+    uint8_t *last = shadow.pages[page];
+    int first = 0;
+    int end = SCREEN_WIDTH - 1;
 
-  server.on("/api/config", HTTP_GET, []()
-            {
-  DynamicJsonDocument doc(1024);
-  doc["desiredDensity"] = config.desiredDensity;
-  doc["measurementInterval"] = config.measurementInterval;
-  doc["fillDuration"] = config.fillDuration;
-  doc["waitDuration"] = config.waitDuration;
-  doc["measurementDuration"] = config.measurementDuration;
-  doc["emptyDuration"] = config.emptyDuration;
-  doc["calibrationOffset"] = config.calibrationOffset;
-  doc["calibrationScale"] = config.calibrationScale;
-  doc["lastMeasurementValue"] = config.lastMeasurementValue;
-  doc["lastMeasurementTime"] = config.lastMeasurementTime;
-  doc["targetAngleMin"] = config.targetAngleMin;
-  doc["targetAngleMax"] = config.targetAngleMax;
-  doc["lastMeasurementAngle"] = config.lastMeasurementAngle;
-  doc["autoMeasurementEnabled"] = config.autoMeasurementEnabled; // NEW
-  
-  String response;
-  serializeJson(doc, response);
-  server.send(200, "application/json", response); });
-
-  // ADD THIS NEW HANDLER HERE:
-  server.on("/api/config", HTTP_POST, []() {
-    if (server.hasArg("plain")) {
-      String body = server.arg("plain");
-      DynamicJsonDocument doc(1024);
-      DeserializationError error = deserializeJson(doc, body);
-      
-      if (error) {
-        server.send(400, "application/json", "{\"error\":\"invalid_json\"}");
-        return;
-      }
-      
-      // Update config values if they exist in the request
-      if (doc.containsKey("desiredDensity")) 
-        config.desiredDensity = doc["desiredDensity"];
-      if (doc.containsKey("measurementInterval")) 
-        config.measurementInterval = doc["measurementInterval"];
-      if (doc.containsKey("fillDuration")) 
-        config.fillDuration = doc["fillDuration"];
-      if (doc.containsKey("waitDuration")) 
-        config.waitDuration = doc["waitDuration"];
-      if (doc.containsKey("measurementDuration")) 
-        config.measurementDuration = doc["measurementDuration"];
-      if (doc.containsKey("emptyDuration")) 
-        config.emptyDuration = doc["emptyDuration"];
-      if (doc.containsKey("calibrationOffset")) 
-        config.calibrationOffset = doc["calibrationOffset"];
-      if (doc.containsKey("calibrationScale")) 
-        config.calibrationScale = doc["calibrationScale"];
-      if (doc.containsKey("targetAngleMin")) 
-        config.targetAngleMin = doc["targetAngleMin"];
-      if (doc.containsKey("targetAngleMax")) 
-        config.targetAngleMax = doc["targetAngleMax"];
-      if (doc.containsKey("autoMeasurementEnabled")) 
-        config.autoMeasurementEnabled = doc["autoMeasurementEnabled"];
-      
-      // Save the updated configuration
-      saveConfig();
-      
-      logSerial("Configuration updated via web interface");
-      server.send(200, "application/json", "{\"status\":\"success\"}");
-    } else {
-      server.send(400, "application/json", "{\"error\":\"no_data\"}");
+    if (shadow.valid)
+    {
+      while (first < SCREEN_WIDTH && row[first] == last[first])
+        first++;
+      if (first == SCREEN_WIDTH)
+        continue; // Page unchanged
+      while (row[end] == last[end])
+        end--;
     }
-  });
 
-  server.on("/api/measure", HTTP_POST, []()
-            {
-    if (!isMeasuring) {
-      performMeasurement();
-      logSerial("Manual measurement started via web interface");
-      server.send(200, "application/json", "{\"status\":\"measurement_started\"}");
-    } else {
-      server.send(400, "application/json", "{\"error\":\"measurement_in_progress\"}");
-    } });
+    // Address window covering just the changed columns of this page
+    if (busMutex)
+      xSemaphoreTake(busMutex, portMAX_DELAY);
+    bus.beginTransmission(OLED_ADDRESS);
+    bus.write((uint8_t)0x00); // Command stream
+    bus.write((uint8_t)SSD1306_COLUMNADDR);
+    bus.write((uint8_t)first);
+    bus.write((uint8_t)end);
+    bus.write((uint8_t)SSD1306_PAGEADDR);
+    bus.write((uint8_t)page);
+    bus.write((uint8_t)page);
+    recordI2cResult(bus, bus.endTransmission());
+    if (busMutex)
+      xSemaphoreGive(busMutex);
+
+    for (int column = first; column <= end; column += OLED_DATA_CHUNK)
+    {
+      if (busMutex)
+        xSemaphoreTake(busMutex, portMAX_DELAY);
+      bus.beginTransmission(OLED_ADDRESS);
+      bus.write((uint8_t)0x40); // Data stream
+      bus.write(row + column, min(OLED_DATA_CHUNK, end - column + 1));
+      recordI2cResult(bus, bus.endTransmission());
+      if (busMutex)
+        xSemaphoreGive(busMutex);
+    }
 
-  server.on("/api/control", HTTP_POST, []()
-            {
-    if (server.hasArg("plain")) {
-      String body = server.arg("plain");
-      DynamicJsonDocument doc(512);
-      deserializeJson(doc, body);
-      
-      String action = doc["action"];
-      bool state = doc["state"];
-      
-      if (action == "fill_solenoid") {
-        digitalWrite(FILL_SOLENOID_PIN, state ? LOW : HIGH);
-        logSerial("Fill solenoid " + String(state ? "activated" : "deactivated") + " via web interface");
-      } else if (action == "empty_solenoid") {
-        digitalWrite(EMPTY_SOLENOID_PIN, state ? LOW : HIGH);
-        logSerial("Empty solenoid " + String(state ? "activated" : "deactivated") + " via web interface");
-      } else if (action == "measuring_relay") {
-        digitalWrite(MEASURING_RELAY_PIN, state ? LOW : HIGH);
-        logSerial("Measuring relay " + String(state ? "activated" : "deactivated") + " via web interface");
-      }
-      
-      server.send(200, "application/json", "{\"status\":\"success\"}");
-    } else {
-      server.send(400, "application/json", "{\"error\":\"no_data\"}");
-    } });
+    memcpy(last + first, row + first, end - first + 1);
+    sent++;
+  }
 
-  server.on("/api/datetime", HTTP_POST, []()
-            {
-    if (server.hasArg("plain")) {
-      String body = server.arg("plain");
-      DynamicJsonDocument doc(512);
-      deserializeJson(doc, body);
-      
-      int year = doc["year"];
-      int month = doc["month"];
-      int day = doc["day"];
-      int hour = doc["hour"];
-      int minute = doc["minute"];
-      int second = doc["second"];
-      
-      // Set DS3231 RTC time
-      rtc.adjust(DateTime(year, month, day, hour, minute, second));
-      
-      // Verify the time was set
-      DateTime now = rtc.now();
-      logSerial("RTC time set to: " + String(now.year()) + "/" + 
-                String(now.month()) + "/" + String(now.day()) + " " + 
-                String(now.hour()) + ":" + String(now.minute()) + ":" + String(now.second()));
-      
-      server.send(200, "application/json", "{\"status\":\"success\"}");
-    } else {
-      server.send(400, "application/json", "{\"error\":\"no_data\"}");
-    } });
+  shadow.valid = true;
+  return sent;
+}
 
-  server.on("/api/data", HTTP_GET, []()
-            {
-    String data = getMeasurementData();
-    server.send(200, "text/plain", data); });
+// Display task: renders the latest status snapshot at a capped frame rate, so
+// screen updates never hold up the control loop or the sensor task
+void displayTask(void *param)
+{
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;)
+  {
+    int64_t frameStart = esp_timer_get_time();
+    updateDisplays(readStatusSnapshot());
+    recordStage(METRIC_DISPLAY, frameStart);
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(DISPLAY_FRAME_INTERVAL_MS));
+  }
+}
 
-  server.on("/api/data", HTTP_DELETE, []()
-            {
-    deleteMeasurementData();
-    logSerial("All measurement data deleted via web interface");
-    server.send(200, "application/json", "{\"status\":\"success\"}"); });
+void startDisplayTask()
+{
+  xTaskCreatePinnedToCore(displayTask, "display", DISPLAY_TASK_STACK, NULL,
+                          DISPLAY_TASK_PRIORITY, NULL, DISPLAY_TASK_CORE);
+}
 
-  // Serve the main page
-  server.on("/", []()
-            {
-    if (LittleFS.exists("/index.html")) {
-      File file = LittleFS.open("/index.html", "r");
-      server.streamFile(file, "text/html");
-      file.close();
-    } else {
-      server.send(404, "text/plain", "index.html not found");
-    } });
+// Build the path of a log segment, e.g. /log/seg_000042.bin (zero padded so names sort)
+void logSegmentPath(char *buffer, size_t length, uint32_t id)
+{
+  snprintf(buffer, length, LOG_DIR "/seg_%06u.bin", (unsigned)id);
+}
 
-  // Handle 404
-  server.onNotFound([]()
-                    { server.send(404, "text/plain", "Not Found"); });
+// Persist the segment index (rewritten only when a segment is added or dropped)
+void saveLogIndex()
+{
+  File file = LittleFS.open(LOG_INDEX_FILE, "w");
+  if (!file)
+  {
+    logSerial("Failed to write log index");
+    return;
+  }
 
-  server.begin();
-  logSerial("Web server started");
+  LogIndexHeader header = {LOG_INDEX_MAGIC, LOG_FORMAT_VERSION, (uint16_t)logSegmentCount};
+  file.write((const uint8_t *)&header, sizeof(header));
+  file.write((const uint8_t *)logSegments, sizeof(LogSegmentInfo) * logSegmentCount);
+  file.close();
+  catalogUpdate(LOG_INDEX_FILE, sizeof(header) + sizeof(LogSegmentInfo) * logSegmentCount);
 }
 
-// File management functions
-String getFileList()
+// Read one record slot from an open segment file
+bool readLogSlot(File &file, uint32_t slot, LogRecord &record)
 {
-  DynamicJsonDocument doc(2048);
-  JsonArray files = doc.createNestedArray("files");
+  if (!file.seek(slot * sizeof(LogRecord)))
+  {
+    return false;
+  }
+  return file.read((uint8_t *)&record, sizeof(record)) == sizeof(record);
+}
 
-  File root = LittleFS.open("/");
-  File file = root.openNextFile();
+// Segments only ever grow by whole records (LittleFS commits a write at close
+// or not at all), so the size gives the record count
+uint32_t findLogWriteSlot(uint32_t id)
+{
+  char path[32];
+  logSegmentPath(path, sizeof(path), id);
+  File file = LittleFS.open(path, "r");
+  if (!file)
+  {
+    return LOG_SEGMENT_RECORDS;
+  }
+  uint32_t records = file.size() / sizeof(LogRecord);
+  file.close();
+  return min(records, (uint32_t)LOG_SEGMENT_RECORDS);
+}
 
-  while (file)
+// Start a new, empty segment file
+bool createLogSegment(uint32_t id, uint32_t firstTimestamp)
+{
+  if (logSegmentCount == LOG_MAX_SEGMENTS)
   {
-    if (!file.isDirectory())
+    // Drop the oldest segment; rotating through ids spreads flash wear
+    char oldPath[32];
+    logSegmentPath(oldPath, sizeof(oldPath), logSegments[0].id);
+    LittleFS.remove(oldPath);
+    catalogRemove(oldPath);
+    memmove(&logSegments[0], &logSegments[1], sizeof(LogSegmentInfo) * (LOG_MAX_SEGMENTS - 1));
+    logSegmentCount--;
+    logSerial("Log full, dropped oldest segment %s", oldPath);
+  }
+
+  char path[32];
+  logSegmentPath(path, sizeof(path), id);
+  File file = LittleFS.open(path, "w");
+  if (!file)
+  {
+    return false;
+  }
+  file.close();
+
+  logSegments[logSegmentCount].id = id;
+  logSegments[logSegmentCount].firstTimestamp = firstTimestamp;
+  logSegmentCount++;
+  logWriteSlot = 0;
+  saveLogIndex();
+  catalogUpdate(path, 0, firstTimestamp, firstTimestamp);
+
+  logSerial("Created log segment %s", path);
+  return true;
+}
+
+// Recreate the index from the segment files themselves (index missing or corrupt)
+void rebuildLogIndex()
+{
+  File dir = LittleFS.open(LOG_DIR);
+  File file = dir.openNextFile();
+  unsigned id;
+
+  while (file && logSegmentCount < LOG_MAX_SEGMENTS)
+  {
+    const char *name = strrchr(file.name(), '/');
+    name = name ? name + 1 : file.name();
+    if (!file.isDirectory() && sscanf(name, "seg_%06u.bin", &id) == 1)
     {
-      JsonObject fileObj = files.createNestedObject();
-      fileObj["name"] = String(file.name());
-      fileObj["size"] = file.size();
+      LogRecord first;
+      if (!readLogSlot(file, 0, first))
+      {
+        first.timestamp = LOG_EMPTY_TIMESTAMP;
+      }
 
-      // Get file modification time if available
-      time_t t = file.getLastWrite();
-      fileObj["lastModified"] = t;
+      // Keep the table sorted by segment id
+      int pos = logSegmentCount;
+      while (pos > 0 && logSegments[pos - 1].id > id)
+      {
+        logSegments[pos] = logSegments[pos - 1];
+        pos--;
+      }
+      logSegments[pos].id = id;
+      logSegments[pos].firstTimestamp = first.timestamp;
+      logSegmentCount++;
     }
-    file = root.openNextFile();
+    file = dir.openNextFile();
   }
 
-  String result;
-  serializeJson(doc, result);
-  return result;
+  if (logSegmentCount > 0)
+  {
+    logSerial("Rebuilt log index from %d segments", (int)logSegmentCount);
+    saveLogIndex();
+  }
 }
 
-bool deleteFile(String filename)
+// Load the segment index and find the append position
+void initMeasurementLog()
+{
+  LittleFS.mkdir(LOG_DIR);
+  logSegmentCount = 0;
+  logWriteSlot = LOG_SEGMENT_RECORDS;
+
+  File file = LittleFS.open(LOG_INDEX_FILE, "r");
+  if (file)
+  {
+    LogIndexHeader header;
+    if (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+        header.magic == LOG_INDEX_MAGIC && header.version == LOG_FORMAT_VERSION &&
+        header.count <= LOG_MAX_SEGMENTS)
+    {
+      size_t bytes = sizeof(LogSegmentInfo) * header.count;
+      if (file.read((uint8_t *)logSegments, bytes) == bytes)
+      {
+        logSegmentCount = header.count;
+      }
+    }
+    file.close();
+  }
+
+  if (logSegmentCount == 0)
+  {
+    rebuildLogIndex();
+  }
+
+  if (logSegmentCount > 0)
+  {
+    logWriteSlot = findLogWriteSlot(logSegments[logSegmentCount - 1].id);
+  }
+
+  // Upload marks name a segment id, so ids keep growing across a delete-all
+  logPrefs.begin(STATE_NVS_NAMESPACE, false);
+  logNextId = logPrefs.getUInt(LOG_NEXT_ID_NVS_KEY, 1);
+  if (logSegmentCount > 0)
+  {
+    logNextId = max(logNextId, logSegments[logSegmentCount - 1].id + 1);
+  }
+
+  logSerial("Measurement log: %d segments, %u records", (int)logSegmentCount, (unsigned)logRecordCount());
+}
+
+// Most recent record in the log, for restoring state at boot
+// Newest record, or the newest one of 'channel'. Channels interleave in the
+// log, so at most the last LOG_SEGMENT_RECORDS records are searched.
+bool readNewestLogRecord(LogRecord &record, int channel)
+{
+  uint32_t count = logRecordCount();
+  uint32_t oldest = count > LOG_SEGMENT_RECORDS ? count - LOG_SEGMENT_RECORDS : 0;
+  char path[32];
+  File file;
+  uint32_t openSegment = UINT32_MAX;
+  bool found = false;
+
+  for (uint32_t index = count; index > oldest && !found; index--)
+  {
+    uint32_t segment = (index - 1) / LOG_SEGMENT_RECORDS;
+    if (segment != openSegment)
+    {
+      logSegmentPath(path, sizeof(path), logSegments[segment].id);
+      file = LittleFS.open(path, "r");
+      openSegment = segment;
+    }
+    found = file && readLogSlot(file, (index - 1) % LOG_SEGMENT_RECORDS, record) &&
+            (channel < 0 || record.flags >> LOG_CHANNEL_SHIFT == channel);
+    if (channel < 0 && !found)
+    {
+      break; // Only the newest slot qualifies
+    }
+  }
+  file.close();
+  return found;
+}
+
+uint32_t logRecordCount()
+{
+  if (logSegmentCount == 0)
+  {
+    return 0;
+  }
+  return (logSegmentCount - 1) * LOG_SEGMENT_RECORDS + logWriteSlot;
+}
+
+// Append one record, starting a new segment when the current one is full
+bool appendLogRecord(const LogRecord &record)
+{
+  xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+  bool ok = appendLogRecordLocked(record);
+  xSemaphoreGive(logStoreMutex);
+  return ok;
+}
+
+bool appendLogRecordLocked(const LogRecord &record)
+{
+  if (logSegmentCount == 0 || logWriteSlot >= LOG_SEGMENT_RECORDS)
+  {
+    if (!createLogSegment(logNextId, record.timestamp))
+    {
+      return false;
+    }
+    logNextId++;
+    logPrefs.putUInt(LOG_NEXT_ID_NVS_KEY, logNextId);
+  }
+
+  char path[32];
+  logSegmentPath(path, sizeof(path), logSegments[logSegmentCount - 1].id);
+
+  // Append only: LittleFS is copy-on-write, so a write into the middle of a
+  // file rewrites everything after it, while an append touches the last block
+  File file = LittleFS.open(path, "a");
+  if (!file)
+  {
+    return false;
+  }
+  bool ok = file.write((const uint8_t *)&record, sizeof(record)) == sizeof(record);
+  file.close();
+
+  if (ok)
+  {
+    logWriteSlot++;
+    catalogUpdate(path, logWriteSlot * sizeof(LogRecord),
+                  logSegments[logSegmentCount - 1].firstTimestamp, record.timestamp);
+  }
+  return ok;
+}
+
+// Position a cursor at the first record with timestamp >= from
+void logSeek(LogCursor &cursor, uint32_t from)
+{
+  cursor.segment = 0;
+  cursor.slot = 0;
+  cursor.file.close();
+
+  // Last segment that starts at or before 'from'
+  while (cursor.segment + 1 < logSegmentCount &&
+         logSegments[cursor.segment + 1].firstTimestamp <= from)
+  {
+    cursor.segment++;
+  }
+
+  if (cursor.segment >= logSegmentCount || from == 0)
+  {
+    return;
+  }
+
+  char path[32];
+  logSegmentPath(path, sizeof(path), logSegments[cursor.segment].id);
+  cursor.file = LittleFS.open(path, "r");
+  if (!cursor.file)
+  {
+    return;
+  }
+
+  uint32_t low = 0;
+  uint32_t high = (cursor.segment == logSegmentCount - 1) ? logWriteSlot : LOG_SEGMENT_RECORDS;
+  LogRecord record;
+  while (low < high)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (readLogSlot(cursor.file, mid, record) && record.timestamp < from)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  cursor.slot = low;
+}
+
+// Read the next record at the cursor. Returns false at the end of the log.
+bool logNext(LogCursor &cursor, LogRecord &record)
+{
+  while (cursor.segment < logSegmentCount)
+  {
+    uint32_t end = (cursor.segment == logSegmentCount - 1) ? logWriteSlot : LOG_SEGMENT_RECORDS;
+    if (cursor.slot < end)
+    {
+      if (!cursor.file)
+      {
+        char path[32];
+        logSegmentPath(path, sizeof(path), logSegments[cursor.segment].id);
+        cursor.file = LittleFS.open(path, "r");
+        if (!cursor.file)
+        {
+          return false;
+        }
+        cursor.file.seek(cursor.slot * sizeof(LogRecord));
+      }
+      if (cursor.file.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+      {
+        return false;
+      }
+      cursor.slot++;
+      return true;
+    }
+
+    cursor.file.close();
+    cursor.segment++;
+    cursor.slot = 0;
+  }
+  return false;
+}
+
+// Updated saveMeasurementData function: appends a binary record to the measurement log
+void saveMeasurementData(float density, float angle, float stddev, uint32_t samples, uint16_t flags,
+                         DateTime timestamp, uint16_t replicates)
 {
-  if (filename.startsWith("/"))
+  flags |= activeChannel << LOG_CHANNEL_SHIFT;
+  LogRecord record = encodeLogRecord(timestamp.unixtime(), density, angle, stddev, samples, flags, replicates);
+
+  if (appendLogRecord(record))
   {
-    return LittleFS.remove(filename);
+    addToRollups(record);
+    if (uploadTaskHandle)
+      xTaskNotifyGive(uploadTaskHandle); // One notification per pending record
+    logSerial("Measurement data saved (record %u)", (unsigned)logRecordCount());
   }
   else
   {
-    return LittleFS.remove("/" + filename);
+    logSerial("Failed to save measurement data to log");
   }
 }
 
-String getFileInfo(String filename)
+void deleteMeasurementData()
 {
-  if (!filename.startsWith("/"))
+  CatalogEntry entry;
+  for (int i = 0; catalogEntry(i, entry);)
   {
-    filename = "/" + filename;
+    if (isLegacyDataFile(entry.name))
+    {
+      LittleFS.remove(entry.name);
+      catalogRemove(entry.name);
+      logSerial("Deleted data file: %s", entry.name);
+    }
+    else
+    {
+      i++;
+    }
   }
 
-  if (LittleFS.exists(filename))
+  char path[32];
+  xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+  int deleted = logSegmentCount;
+  for (int i = 0; i < logSegmentCount; i++)
   {
-    File file = LittleFS.open(filename, "r");
-    if (file)
+    logSegmentPath(path, sizeof(path), logSegments[i].id);
+    LittleFS.remove(path);
+    catalogRemove(path);
+  }
+  LittleFS.remove(LOG_INDEX_FILE);
+  catalogRemove(LOG_INDEX_FILE);
+
+  logSegmentCount = 0;
+  logWriteSlot = LOG_SEGMENT_RECORDS;
+  xSemaphoreGive(logStoreMutex);
+
+  clearRollups();
+  logSerial("Deleted %d log segments", (int)deleted);
+}
+
+// Delete the measurement files whose data lies entirely within [from, to]:
+// legacy CSVs and whole log segments, picked from the catalog's data ranges.
+// Removing whole segments keeps every segment but the newest full, which the
+// log's record addressing relies on.
+void deleteMeasurementRange(uint32_t from, uint32_t to)
+{
+  int files = 0, segments = 0;
+  CatalogEntry entry;
+  unsigned id;
+
+  xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+  for (int i = 0; catalogEntry(i, entry);)
+  {
+    const char *base = strrchr(entry.name, '/') + 1;
+    if (entry.dataFrom == 0 || entry.dataFrom < from || entry.dataTo > to)
     {
-      DynamicJsonDocument doc(512);
-      doc["name"] = filename;
-      doc["size"] = file.size();
-      doc["lastModified"] = file.getLastWrite();
-      file.close();
+      i++;
+    }
+    else if (isLegacyDataFile(entry.name))
+    {
+      LittleFS.remove(entry.name);
+      catalogRemove(entry.name);
+      files++;
+    }
+    else if (sscanf(base, "seg_%06u.bin", &id) == 1)
+    {
+      for (int s = 0; s < logSegmentCount; s++)
+      {
+        if (logSegments[s].id != id)
+          continue;
+        if (s == logSegmentCount - 1)
+        {
+          logWriteSlot = LOG_SEGMENT_RECORDS; // Next record opens a new segment
+        }
+        memmove(&logSegments[s], &logSegments[s + 1], sizeof(LogSegmentInfo) * (logSegmentCount - s - 1));
+        logSegmentCount--;
+        break;
+      }
+      LittleFS.remove(entry.name);
+      catalogRemove(entry.name);
+      segments++;
+    }
+    else
+    {
+      i++;
+    }
+  }
+  if (segments > 0)
+  {
+    saveLogIndex();
+  }
+  xSemaphoreGive(logStoreMutex);
+
+  if (segments > 0)
+  {
+    rebuildRollups();
+  }
+  logSerial("Range delete: %d data files, %d log segments", files, segments);
+}
+
+// Fold one log record into the hourly, daily and batch rollups. Replicates are
+// skipped, their series record stands for them. Rollups follow channel 0.
+void addToRollups(const LogRecord &record)
+{
+  if ((record.flags & LOG_FLAG_REPLICATE) || record.flags >> LOG_CHANNEL_SHIFT != 0)
+  {
+    return;
+  }
 
-      String result;
-      serializeJson(doc, result);
-      return result;
+  portENTER_CRITICAL(&rollupMux);
+  rollupAdd(hourlyRollup, ROLLUP_HOURS, 3600, record.timestamp, record.density);
+  rollupAdd(dailyRollup, ROLLUP_DAYS, 86400, record.timestamp, record.density);
+  for (int i = batchCount - 1; i >= 0; i--)
+  {
+    if (record.timestamp >= batches[i].start)
+    {
+      batchRollup[i].add(record.density);
+      break;
     }
   }
-  return "{}";
+  portEXIT_CRITICAL(&rollupMux);
 }
 
-// Replace the blocking performMeasurement() function with this non-blocking version
-void performMeasurement()
+void clearRollups()
 {
-  if (measurementState == IDLE)
+  portENTER_CRITICAL(&rollupMux);
+  memset(hourlyRollup, 0, sizeof(hourlyRollup));
+  memset(dailyRollup, 0, sizeof(dailyRollup));
+  for (int i = 0; i < batchCount; i++)
   {
-    // Start the measurement sequence
-    measurementState = EMPTYING_INITIAL;
-    stateStartTime = millis();
-    isMeasuring = true;
+    batchRollup[i].reset(batches[i].start);
+  }
+  portEXIT_CRITICAL(&rollupMux);
+}
 
-    // Reset measurement variables
-    angleSum = 0.0;
-    validReadings = 0;
-    measurementCount = 0;
-    lastAngleReadTime = 0;
+// Boot: one pass over the binary log. Rows in legacy CSV files are not included.
+void rebuildRollups()
+{
+  unsigned long started = millis();
+  clearRollups();
+
+  LogCursor cursor;
+  LogRecord record;
+  uint32_t records = 0;
+  xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+  logSeek(cursor, 0);
+  while (logNext(cursor, record))
+  {
+    addToRollups(record);
+    records++;
+  }
+  cursor.file.close();
+  xSemaphoreGive(logStoreMutex);
 
-    // Ensure empty solenoid is closed
-    digitalWrite(EMPTY_SOLENOID_PIN, HIGH);
+  logSerial("Rollups rebuilt from %u records in %lu ms", (unsigned)records, millis() - started);
+}
+
+void loadBatches()
+{
+  batchCount = 0;
+  File file = LittleFS.open(BATCH_FILE, "r");
+  if (!file)
+  {
+    return;
+  }
+  while (batchCount < ROLLUP_BATCHES &&
+         file.read((uint8_t *)&batches[batchCount], sizeof(BatchInfo)) == sizeof(BatchInfo))
+  {
+    batches[batchCount].name[BATCH_NAME_MAX - 1] = '\0';
+    batchRollup[batchCount].reset(batches[batchCount].start);
+    batchCount++;
+  }
+  file.close();
+}
 
-    logSerial("Starting measurement sequence...");
+void saveBatches()
+{
+  File file = LittleFS.open(BATCH_FILE, "w");
+  if (!file)
+  {
+    logSerial("Failed to save %s", BATCH_FILE);
+    return;
   }
+  file.write((const uint8_t *)batches, batchCount * sizeof(BatchInfo));
+  file.close();
+  catalogUpdate(BATCH_FILE, batchCount * sizeof(BatchInfo));
 }
 
-// Add this function to handle the measurement state machine
-void updateMeasurementState()
+// Control loop: begin a new production batch now, dropping the oldest if full
+void startBatch(const char *name)
 {
-  if (measurementState == IDLE)
+  portENTER_CRITICAL(&rollupMux);
+  if (batchCount == ROLLUP_BATCHES)
   {
-    return;
+    memmove(&batches[0], &batches[1], sizeof(BatchInfo) * (ROLLUP_BATCHES - 1));
+    memmove(&batchRollup[0], &batchRollup[1], sizeof(RollupBucket) * (ROLLUP_BATCHES - 1));
+    batchCount--;
   }
+  BatchInfo &batch = batches[batchCount];
+  batch.id = batchCount > 0 ? batches[batchCount - 1].id + 1 : 1;
+  batch.start = nowUnix();
+  strncpy(batch.name, name, BATCH_NAME_MAX - 1);
+  batch.name[BATCH_NAME_MAX - 1] = '\0';
+  batchRollup[batchCount].reset(batch.start);
+  batchCount++;
+  portEXIT_CRITICAL(&rollupMux);
+
+  saveBatches();
+  logSerial("Batch %u '%s' started", (unsigned)batch.id, batch.name);
+}
 
-  unsigned long currentTime = millis();
-  unsigned long elapsedTime = currentTime - stateStartTime;
+static void writeRollupBucket(AsyncResponseStream *out, const RollupBucket &bucket, bool first)
+{
+  out->printf("%s{\"start\":%u,\"count\":%u,\"min\":%.4f,\"max\":%.4f,\"mean\":%.4f}", first ? "" : ",",
+              (unsigned)bucket.start, (unsigned)bucket.count, bucket.min, bucket.max, bucket.mean());
+}
 
-  switch (measurementState)
+// The last 'limit' periods of a ring, oldest first; empty periods are left out
+static void writeRollupRing(AsyncResponseStream *out, const RollupBucket *ring, int size, uint32_t period, int limit)
+{
+  uint32_t newest = 0;
+  for (int i = 0; i < size; i++)
   {
-  case EMPTYING_INITIAL:
-    if (elapsedTime >= 1000)
-    { // 1 second delay
-      // Step 2: Fill chamber
-      digitalWrite(FILL_SOLENOID_PIN, LOW);
-      measurementState = FILLING;
-      stateStartTime = currentTime;
-      logSerial("Filling chamber...");
-    }
-    break;
+    newest = max(newest, ring[i].start);
+  }
 
-  case FILLING:
-    if (elapsedTime >= (config.fillDuration * 1000))
+  bool first = true;
+  for (int k = limit - 1; newest > 0 && k >= 0; k--)
+  {
+    if (newest < (uint32_t)k * period)
+      continue;
+    uint32_t start = newest - k * period;
+    const RollupBucket &bucket = ring[(start / period) % size];
+    if (bucket.start == start && bucket.count > 0)
     {
-      digitalWrite(FILL_SOLENOID_PIN, HIGH);
-      measurementState = WAITING_TO_SETTLE;
-      stateStartTime = currentTime;
-      logSerial("Waiting for settling...");
+      writeRollupBucket(out, bucket, first);
+      first = false;
     }
-    break;
+  }
+}
 
-  case WAITING_TO_SETTLE:
-    if (elapsedTime >= (config.waitDuration * 1000))
-    {
-      measurementState = MEASURING;
-      stateStartTime = currentTime;
-      lastAngleReadTime = currentTime;
-      logSerial("Starting angle measurements...");
+// GET /api/summary[?hours=24&days=31]: hourly, daily and per-batch density
+// rollups. POST /api/batch {"name": "..."} starts a new batch.
+void setupSummaryEndpoints()
+{
+  server.on("/api/summary", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    int hours = request->hasParam("hours") ? constrain(request->getParam("hours")->value().toInt(), 1, ROLLUP_HOURS) : 24;
+    int days = request->hasParam("days") ? constrain(request->getParam("days")->value().toInt(), 1, ROLLUP_DAYS) : 31;
+
+    std::unique_ptr<RollupBucket[]> copy(new (std::nothrow) RollupBucket[ROLLUP_HOURS + ROLLUP_DAYS + ROLLUP_BATCHES]);
+    std::unique_ptr<BatchInfo[]> batchCopy(new (std::nothrow) BatchInfo[ROLLUP_BATCHES]);
+    if (!copy || !batchCopy) {
+      request->send(503, "application/json", "{\"error\":\"out_of_memory\"}");
+      return;
     }
-    break;
-
-  case MEASURING:
-    // Take angle readings every second
-    if (currentTime - lastAngleReadTime >= 1000)
-    {
-      if (measurementCount < config.measurementDuration)
-      {
-        sensors_event_t a, g, temp;
-        mpu.getEvent(&a, &g, &temp);
-
-        // Calculate angle from accelerometer
-        float angle = atan2(a.acceleration.y, a.acceleration.z) * 180.0 / PI;
+    RollupBucket *hourly = copy.get();
+    RollupBucket *daily = hourly + ROLLUP_HOURS;
+    RollupBucket *perBatch = daily + ROLLUP_DAYS;
+
+    portENTER_CRITICAL(&rollupMux);
+    memcpy(hourly, hourlyRollup, sizeof(hourlyRollup));
+    memcpy(daily, dailyRollup, sizeof(dailyRollup));
+    memcpy(perBatch, batchRollup, sizeof(batchRollup));
+    memcpy(batchCopy.get(), batches, sizeof(batches));
+    int count = batchCount;
+    portEXIT_CRITICAL(&rollupMux);
+
+    AsyncResponseStream *out = request->beginResponseStream("application/json");
+    out->print("{\"hourly\":[");
+    writeRollupRing(out, hourly, ROLLUP_HOURS, 3600, hours);
+    out->print("],\"daily\":[");
+    writeRollupRing(out, daily, ROLLUP_DAYS, 86400, days);
+    out->print("],\"batches\":[");
+    for (int i = 0; i < count; i++) {
+      const BatchInfo &batch = batchCopy[i];
+      const RollupBucket &bucket = perBatch[i];
+      out->printf("%s{\"id\":%u,\"name\":\"", i ? "," : "", (unsigned)batch.id);
+      for (const char *c = batch.name; *c; c++) {
+        if (*c == '"' || *c == '\\')
+          out->print('\\');
+        if ((uint8_t)*c >= 0x20)
+          out->print(*c);
+      }
+      out->printf("\",\"start\":%u,\"count\":%u,\"min\":%.4f,\"max\":%.4f,\"mean\":%.4f}",
+                  (unsigned)batch.start, (unsigned)bucket.count, bucket.count ? bucket.min : 0.0f,
+                  bucket.count ? bucket.max : 0.0f, bucket.mean());
+    }
+    out->printf("],\"currentBatch\":%u}", count ? (unsigned)batchCopy[count - 1].id : 0);
+    request->send(out); });
 
-        // Validate reading
-        if (abs(angle) < 90)
-        { // Reasonable angle range
-          angleSum += angle;
-          validReadings++;
-        }
+  server.on("/api/batch", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
+    const char *name = doc["name"] | "";
+    if (!*name) {
+      request->send(400, "application/json", "{\"error\":\"missing_name\"}");
+      return;
+    }
 
-        measurementCount++;
-        lastAngleReadTime = currentTime;
+    ControlCommand command;
+    command.type = CMD_NEW_BATCH;
+    strncpy(command.name, name, BATCH_NAME_MAX - 1);
+    command.name[BATCH_NAME_MAX - 1] = '\0';
+    if (postControlCommand(command)) {
+      request->send(200, "application/json", "{\"status\":\"success\"}");
+    } else {
+      request->send(503, "application/json", "{\"error\":\"busy\"}");
+    } }, NULL, collectRequestBody);
+}
 
-        logSerial("Measurement " + String(measurementCount) + "/" +
-                  String(config.measurementDuration) + " - Angle: " +
-                  String(angle, 2) + "°");
-      }
-      else
-      {
-        // Measurement complete, process results
-        if (validReadings > 0)
-        {
-          currentAngle = (angleSum / validReadings) + config.calibrationOffset;
-          currentDensity = angleToDensity(currentAngle * config.calibrationScale);
-          lastMeasurement = currentDensity;
-          lastMeasurementTime = rtc.now();
-
-          // Update config with new measurement data including angle
-          config.lastMeasurementValue = currentDensity;
-          config.lastMeasurementAngle = currentAngle;
-          config.lastMeasurementTime = lastMeasurementTime.unixtime();
-          saveConfig(); // Save the measurement data to settings
-
-          // Log measurement details
-          logSerial("Measurement completed - Angle: " + String(currentAngle, 2) +
-                    "°, Density: " + String(currentDensity, 4) +
-                    ", Valid readings: " + String(validReadings) + "/" +
-                    String(config.measurementDuration));
-
-          // Save measurement data including angle
-          saveMeasurementData(currentDensity, currentAngle, lastMeasurementTime);
-        }
-        else
-        {
-          logSerial("No valid readings obtained during measurement");
-        }
+// Station settings from network.bin; without one station mode stays off
+void loadNetworkConfig()
+{
+  memset(&networkConfig, 0, sizeof(networkConfig));
+  networkConfig.uploadIntervalS = UPLOAD_INTERVAL_DEFAULT_S;
 
-        // Move to emptying phase
-        digitalWrite(EMPTY_SOLENOID_PIN, LOW);
-        measurementState = EMPTYING_FINAL;
-        stateStartTime = currentTime;
-        logSerial("Emptying chamber...");
-      }
+  File file = LittleFS.open(NETWORK_FILE, "r");
+  if (file)
+  {
+    SettingsHeader header;
+    NetworkConfig stored = networkConfig;
+    bool ok = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+              header.magic == NETWORK_MAGIC && header.version <= NETWORK_VERSION;
+    if (ok)
+    {
+      size_t known = min((size_t)header.size, sizeof(stored));
+      ok = file.read((uint8_t *)&stored, known) == known &&
+           crc32_le(0, (const uint8_t *)&stored, known) == header.crc;
     }
-    break;
+    file.close();
 
-  case EMPTYING_FINAL:
-    if (elapsedTime >= (config.emptyDuration * 1000))
+    if (ok)
     {
-      digitalWrite(EMPTY_SOLENOID_PIN, HIGH);
-
-      // Calculate next measurement time based on current measurement
-      DateTime now = rtc.now();
-      // Convert minutes to seconds: config.measurementInterval * 60
-      nextMeasurementTime = DateTime((uint32_t)(now.unixtime() + (config.measurementInterval * 60)));
+      stored.ssid[sizeof(stored.ssid) - 1] = '\0';
+      stored.password[sizeof(stored.password) - 1] = '\0';
+      stored.collectorUrl[sizeof(stored.collectorUrl) - 1] = '\0';
+      networkConfig = stored;
+    }
+    else
+    {
+      logSerial("network.bin failed the integrity check");
+    }
+  }
+  requestedNetwork = networkConfig;
+}
 
-      // Reset state
-      measurementState = IDLE;
-      isMeasuring = false;
+bool saveNetworkConfig(const NetworkConfig &settings)
+{
+  SettingsHeader header;
+  header.magic = NETWORK_MAGIC;
+  header.version = NETWORK_VERSION;
+  header.size = sizeof(settings);
+  header.crc = crc32_le(0, (const uint8_t *)&settings, sizeof(settings));
 
-      logSerial("Measurement sequence complete");
-      logSerial("Next measurement scheduled for: " + String(nextMeasurementTime.timestamp()));
+  File file = LittleFS.open(NETWORK_TEMP_FILE, "w");
+  if (file)
+  {
+    bool ok = file.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+              file.write((const uint8_t *)&settings, sizeof(settings)) == sizeof(settings);
+    file.close();
+    if (ok && LittleFS.rename(NETWORK_TEMP_FILE, NETWORK_FILE))
+    {
+      catalogUpdate(NETWORK_FILE, sizeof(header) + sizeof(settings));
+      return true;
     }
-    break;
   }
+  logSerial("Failed to save network settings");
+  return false;
 }
 
-// Update the controlRelays function to use the state machine
-void controlRelays()
+// Join the plant network next to the AP, or leave it again. The AP stays up
+// either way, so the device remains reachable on site.
+void applyStationMode()
 {
-  // Control measuring pilot lamp using single relay
-  // LOW = Red light (NC), HIGH = Green light (NO)
-  if (isMeasuring)
+  if (networkConfig.enabled && networkConfig.ssid[0])
   {
-    digitalWrite(MEASURING_RELAY_PIN, HIGH); // Green light (NO)
+    WiFi.mode(WIFI_AP_STA);
+    WiFi.setAutoReconnect(true);
+    WiFi.begin(networkConfig.ssid, networkConfig.password);
+    logSerial("Joining WiFi network %s", networkConfig.ssid);
   }
   else
   {
-    digitalWrite(MEASURING_RELAY_PIN, LOW); // Red light (NC)
+    WiFi.mode(WIFI_AP);
+    logSerial("Station mode off");
   }
 }
 
-// Updated updateDisplays function with angle information
-void updateDisplays()
+// Next records after 'from', at most 'max'. 'next' is the mark to store once
+// the collector has acknowledged them. A segment deleted meanwhile, or a whole
+// log cleared, resumes at the start of the next segment: ids are never reused
+// (logNextId). A mark past the end of the log (NVS lost) resumes at the oldest
+// record.
+int readUploadBatch(const UploadMark &from, LogRecord *records, int max, UploadMark &next)
 {
-  DateTime now = rtc.now();
-
-  // Check if it's time to switch display pages (every 3 seconds)
-  if (millis() - lastDisplayUpdate >= 3000)
+  LogCursor cursor;
+  LogRecord record;
+  int count = 0;
+  next = from;
+
+  xSemaphoreTake(logStoreMutex, portMAX_DELAY);
+  cursor.segment = 0;
+  cursor.slot = 0;
+  while (cursor.segment < logSegmentCount && logSegments[cursor.segment].id < from.segmentId)
   {
-    displayPage = (displayPage + 1) % 2; // Toggle between 0 and 1
-    lastDisplayUpdate = millis();
+    cursor.segment++;
+  }
+  if (cursor.segment < logSegmentCount && logSegments[cursor.segment].id == from.segmentId)
+  {
+    uint32_t end = (cursor.segment == logSegmentCount - 1) ? logWriteSlot : LOG_SEGMENT_RECORDS;
+    cursor.slot = from.index;
+    if (from.index > end)
+    {
+      cursor.segment = logSegmentCount; // Beyond what the log holds
+    }
+  }
+  if (cursor.segment >= logSegmentCount)
+  {
+    cursor.segment = 0;
+    cursor.slot = 0;
   }
 
-  // Display 1: Target angle range and next measurement time (2 pages)
-  display1.clearDisplay();
-  display1.setTextSize(1);
+  while (count < max && logNext(cursor, record))
+  {
+    records[count++] = record;
+    next.segmentId = logSegments[cursor.segment].id;
+    next.index = cursor.slot; // logNext() leaves the cursor after the record
+  }
+  cursor.file.close(); // Before a delete can remove the segment
+  xSemaphoreGive(logStoreMutex);
+  return count;
+}
 
-  if (displayPage == 0)
+// POST the header and the 'count' records already in uploadBuffer. Returns
+// the HTTP status, negative for connection errors.
+int postUploadBatch(int count)
+{
+  UploadHeader header;
+  uint64_t mac = ESP.getEfuseMac();
+  header.magic = UPLOAD_MAGIC;
+  header.version = UPLOAD_VERSION;
+  header.headerSize = sizeof(header);
+  memcpy(header.deviceId, &mac, sizeof(header.deviceId));
+  header.recordSize = sizeof(LogRecord);
+  header.count = count;
+  header.sentAt = nowUnix();
+  header.uptimeS = millis() / 1000;
+  header.freeHeap = ESP.getFreeHeap();
+  header.minFreeHeap = ESP.getMinFreeHeap();
+  header.sampleOverruns = sampleOverruns;
+  header.rssi = WiFi.RSSI();
+  header.probeChannels = PROBE_CHANNELS;
+  header.reserved = 0;
+  memcpy(uploadBuffer, &header, sizeof(header));
+
+  HTTPClient http;
+  http.setConnectTimeout(UPLOAD_HTTP_TIMEOUT_MS);
+  http.setTimeout(UPLOAD_HTTP_TIMEOUT_MS);
+  if (!http.begin(networkConfig.collectorUrl))
   {
-    // Page 0: Target angle range
-    display1.setCursor(0, 0);
-    display1.println("TARGET ANGLE");
-    display1.setCursor(0, 16);
-    display1.setTextSize(2); // Larger text for the values
-    display1.printf("%.0f-%.0f°", config.targetAngleMin, config.targetAngleMax);
+    return -1;
   }
-  else
+  http.addHeader("Content-Type", "application/octet-stream");
+  int code = http.POST(uploadBuffer, sizeof(header) + count * sizeof(LogRecord));
+  http.end();
+  return code;
+}
+
+// Store-and-forward uploader. Records stay in the flash log and the collector
+// gets everything after the acknowledged mark, so an outage or a reboot only
+// delays them. Waits for a full batch or the upload interval, then sends until
+// caught up; failed uploads back off exponentially.
+void uploadTask(void *param)
+{
+  UploadMark mark = {0, 0};
+  uploadPrefs.begin(STATE_NVS_NAMESPACE, false);
+  if (uploadPrefs.getBytesLength(UPLOAD_NVS_KEY) == sizeof(mark)) // Else start from the oldest record
+    uploadPrefs.getBytes(UPLOAD_NVS_KEY, &mark, sizeof(mark));
+  portENTER_CRITICAL(&uploadMux);
+  uploadStatus.acked = mark;
+  portEXIT_CRITICAL(&uploadMux);
+
+  LogRecord *records = (LogRecord *)(uploadBuffer + sizeof(UploadHeader));
+  uint32_t pending = UPLOAD_BATCH_RECORDS; // Send what the log gained while offline right away
+  uint32_t retryS = 0;
+  unsigned long lastAttempt = 0;
+
+  for (;;)
   {
-    // Page 1: Next measurement time
-    display1.setCursor(0, 0);
-    if (nextMeasurementTime.unixtime() > 0)
+    pending += ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+
+    bool changed = false;
+    portENTER_CRITICAL(&uploadMux);
+    if (networkChanged)
     {
-      display1.println("NEXT MEASUREMENT");
-      display1.setCursor(0, 16);
-      display1.printf("%02d:%02d %02d/%02d/%02d",
-                      nextMeasurementTime.hour(),
-                      nextMeasurementTime.minute(),
-                      nextMeasurementTime.day(),
-                      nextMeasurementTime.month(),
-                      nextMeasurementTime.year() % 100);
+      networkConfig = requestedNetwork;
+      networkChanged = false;
+      changed = true;
     }
-    else
+    portEXIT_CRITICAL(&uploadMux);
+    if (changed)
     {
-      display1.println("NO SCHEDULED");
-      display1.setCursor(0, 16);
-      display1.println("MEASUREMENT");
+      saveNetworkConfig(networkConfig);
+      applyStationMode();
+      pending = UPLOAD_BATCH_RECORDS;
+      retryS = 0;
     }
-  }
-  display1.display();
-
-  // Display 2: Last measurement angle and current time (2 pages)
-  display2.clearDisplay();
-  display2.setTextSize(1);
 
-  if (displayPage == 0)
-  {
-    // Page 0: Last measurement angle
-    display2.setCursor(0, 0);
-    display2.println("LAST MEASUREMENT");
-    display2.setCursor(0, 16);
-    display2.setTextSize(2); // Larger text for the value
-    if (config.lastMeasurementAngle > 0)
+    if (!networkConfig.enabled || pending == 0 || WiFi.status() != WL_CONNECTED)
     {
-      display2.printf("%.1f°", config.lastMeasurementAngle);
+      continue;
     }
-    else
+    unsigned long elapsed = millis() - lastAttempt;
+    if (retryS ? elapsed < retryS * 1000UL
+               : pending < UPLOAD_BATCH_RECORDS && elapsed < networkConfig.uploadIntervalS * 1000UL)
     {
-      display2.print("--°");
+      continue;
     }
-  }
-  else
-  {
-    // Page 1: Current time and status
-    display2.setCursor(0, 0);
-    display2.println("CURRENT TIME");
-    display2.setCursor(0, 12);
-    display2.printf("%02d:%02d:%02d %02d/%02d",
-                    now.hour(),
-                    now.minute(),
-                    now.second(),
-                    now.day(),
-                    now.month());
+    lastAttempt = millis();
 
-    // Show measurement status on second line
-    display2.setCursor(0, 20);
-    if (isMeasuring)
+    int code = 0;
+    int count = 0;
+    uint32_t sent = 0;
+    bool failed = false;
+    do
     {
-      switch (measurementState)
+      UploadMark next;
+      count = readUploadBatch(mark, records, UPLOAD_BATCH_RECORDS, next);
+      if (count == 0)
       {
-      case EMPTYING_INITIAL:
-        display2.print("PREPARING");
-        break;
-      case FILLING:
-        display2.print("FILLING");
-        break;
-      case WAITING_TO_SETTLE:
-        display2.print("SETTLING");
-        break;
-      case MEASURING:
-        display2.printf("MEAS %d/%d", measurementCount, config.measurementDuration);
         break;
-      case EMPTYING_FINAL:
-        display2.print("EMPTYING");
-        break;
-      default:
-        display2.print("MEASURING");
       }
+      code = postUploadBatch(count);
+      failed = code < 200 || code >= 300;
+      if (!failed)
+      {
+        mark = next;
+        uploadPrefs.putBytes(UPLOAD_NVS_KEY, &mark, sizeof(mark));
+        sent += count;
+      }
+
+      uint32_t now = nowUnix();
+      portENTER_CRITICAL(&uploadMux);
+      uploadStatus.lastHttpCode = code;
+      if (failed)
+      {
+        uploadStatus.failures++;
+      }
+      else
+      {
+        uploadStatus.acked = mark;
+        uploadStatus.lastUpload = now;
+        uploadStatus.records += count;
+        uploadStatus.batches++;
+      }
+      portEXIT_CRITICAL(&uploadMux);
+    } while (!failed && count == UPLOAD_BATCH_RECORDS);
+
+    if (failed)
+    {
+      retryS = retryS ? min(retryS * 2, (uint32_t)UPLOAD_RETRY_MAX_S) : UPLOAD_RETRY_MIN_S;
+      logSerial("Upload failed (HTTP %d), retrying in %u s", code, (unsigned)retryS);
     }
     else
     {
-      display2.print("READY");
+      pending = 0;
+      retryS = 0;
     }
+    if (sent > 0)
+    {
+      logSerial("Uploaded %u records to the collector", (unsigned)sent);
+    }
+
+    portENTER_CRITICAL(&uploadMux);
+    uploadStatus.retryS = retryS;
+    portEXIT_CRITICAL(&uploadMux);
   }
-  display2.display();
 }
 
-// Updated saveMeasurementData function to include angle
-void saveMeasurementData(float density, float angle, DateTime timestamp)
+void startUploadTask()
 {
-  String filename = "/data_" + String(timestamp.year()) +
-                    String(timestamp.month()) +
-                    String(timestamp.day()) + ".csv";
-
-  File file = LittleFS.open(filename, "a");
-  if (file)
-  {
-    file.printf("%04d-%02d-%02d %02d:%02d:%02d,%.4f,%.2f\n",
-                timestamp.year(), timestamp.month(), timestamp.day(),
-                timestamp.hour(), timestamp.minute(), timestamp.second(),
-                density, angle);
-    file.close();
-    logSerial("Measurement data saved to " + filename);
-  }
-  else
-  {
-    logSerial("Failed to save measurement data to " + filename);
-  }
+  xTaskCreatePinnedToCore(uploadTask, "upload", UPLOAD_TASK_STACK, NULL,
+                          UPLOAD_TASK_PRIORITY, &uploadTaskHandle, UPLOAD_TASK_CORE);
 }
 
-String getMeasurementData()
+void setupNetworkEndpoints()
 {
-  String data = "Timestamp,Density,Angle\n";
+  // Station settings and uploader progress; the password is never sent back
+  server.on("/api/network", HTTP_GET, [](AsyncWebServerRequest *request)
+            {
+    portENTER_CRITICAL(&uploadMux);
+    NetworkConfig settings = requestedNetwork;
+    UploadStatus status = uploadStatus;
+    portEXIT_CRITICAL(&uploadMux);
+
+    JsonDocument &doc = apiDocument();
+    doc["enabled"] = settings.enabled != 0;
+    doc["ssid"] = settings.ssid;
+    doc["passwordSet"] = settings.password[0] != '\0';
+    doc["collectorUrl"] = settings.collectorUrl;
+    doc["uploadIntervalS"] = settings.uploadIntervalS;
+
+    bool connected = WiFi.status() == WL_CONNECTED;
+    doc["connected"] = connected;
+    if (connected) {
+      doc["ip"] = WiFi.localIP().toString();
+      doc["rssi"] = WiFi.RSSI();
+    }
 
-  File root = LittleFS.open("/");
-  File file = root.openNextFile();
+    JsonObject upload = doc.createNestedObject("upload");
+    upload["ackedSegment"] = status.acked.segmentId;
+    upload["ackedIndex"] = status.acked.index;
+    upload["lastUpload"] = status.lastUpload;
+    upload["records"] = status.records;
+    upload["batches"] = status.batches;
+    upload["failures"] = status.failures;
+    upload["lastHttpCode"] = status.lastHttpCode;
+    upload["retryS"] = status.retryS;
+    sendJson(request, doc); });
+
+  // Fields left out keep their value, so the password need not be resent
+  server.on("/api/network", HTTP_POST, [](AsyncWebServerRequest *request)
+            {
+    JsonDocument &doc = apiDocument();
+    if (!parseRequestBody(request, doc)) {
+      return;
+    }
 
-  while (file)
-  {
-    String filename = file.name();
-    if (filename.startsWith("/data_") && filename.endsWith(".csv"))
-    {
-      File dataFile = LittleFS.open(filename, "r");
-      if (dataFile)
-      {
-        while (dataFile.available())
-        {
-          data += dataFile.readString();
-        }
-        dataFile.close();
-      }
+    portENTER_CRITICAL(&uploadMux);
+    NetworkConfig settings = requestedNetwork;
+    portEXIT_CRITICAL(&uploadMux);
+
+    const char *ssid = doc["ssid"];
+    const char *password = doc["password"];
+    const char *url = doc["collectorUrl"];
+    if ((ssid && strlen(ssid) >= sizeof(settings.ssid)) ||
+        (password && strlen(password) >= sizeof(settings.password)) ||
+        (url && strlen(url) >= sizeof(settings.collectorUrl))) {
+      request->send(400, "application/json", "{\"error\":\"value_too_long\"}");
+      return;
+    }
+    if (url && *url && strncmp(url, "http://", 7) != 0) {
+      request->send(400, "application/json", "{\"error\":\"http_url_required\"}");
+      return;
     }
-    file = root.openNextFile();
-  }
 
-  return data;
+    if (doc.containsKey("enabled"))
+      settings.enabled = doc["enabled"].as<bool>();
+    if (ssid)
+      strcpy(settings.ssid, ssid);
+    if (password)
+      strcpy(settings.password, password);
+    if (url)
+      strcpy(settings.collectorUrl, url);
+    if (doc.containsKey("uploadIntervalS"))
+      settings.uploadIntervalS = constrain(doc["uploadIntervalS"].as<int>(), 10, 3600);
+
+    if (settings.enabled && (!settings.ssid[0] || !settings.collectorUrl[0])) {
+      request->send(400, "application/json", "{\"error\":\"ssid_and_url_required\"}");
+      return;
+    }
+
+    portENTER_CRITICAL(&uploadMux);
+    requestedNetwork = settings;
+    networkChanged = true;
+    portEXIT_CRITICAL(&uploadMux);
+    if (uploadTaskHandle)
+      xTaskNotifyGive(uploadTaskHandle);
+    request->send(200, "application/json", "{\"status\":\"success\"}"); }, NULL, collectRequestBody);
 }
 
-void deleteMeasurementData()
+// Density for a raw probe angle, constant time from the fixed-point table
+float angleToDensity(float angle)
 {
-  File root = LittleFS.open("/");
-  File file = root.openNextFile();
+  return lutDensity(calibrationLut, angle);
+}
 
-  while (file)
-  {
-    String filename = file.name();
-    if (filename.startsWith("/data_") && filename.endsWith(".csv"))
-    {
-      LittleFS.remove(filename);
-      logSerial("Deleted data file: " + filename);
-    }
-    file = root.openNextFile();
-  }
+// Calibration curve evaluated exactly; only used to fill the lookup table
+float calibrationCurve(const Config &settings, float angle)
+{
+  return calibrationDensity(angle, settings.calibrationPointCount, settings.calibrationAngles,
+                            settings.calibrationDensities, settings.calibrationOffset,
+                            settings.calibrationScale);
 }
 
-float angleToDensity(float angle)
+// Precompute the table after every calibration change
+void buildCalibrationLut()
 {
-  // Convert angle to density using calibration
-  // This function converts the MPU6050 tilt angle to Claybath density
-  // You'll need to calibrate this based on your specific probe setup
+  buildDensityLut(calibrationLut, config.calibrationPointCount, config.calibrationAngles,
+                  config.calibrationDensities, config.calibrationOffset, config.calibrationScale);
+  logSerial("Calibration table built (%d reference points)", config.calibrationPointCount);
+}
+
+// Validate [{angle, density}, ...] and store it sorted by angle. An empty
+// array returns to the linear formula.
+bool setCalibrationPoints(Config &settings, JsonArrayConst points)
+{
+  int count = points.size();
+  if (count == 1 || count > CAL_MAX_POINTS)
+  {
+    return false;
+  }
 
-  // Apply calibration offset and scale
-  float calibratedAngle = (angle + config.calibrationOffset) * config.calibrationScale;
+  float angles[CAL_MAX_POINTS];
+  float densities[CAL_MAX_POINTS];
+  for (int i = 0; i < count; i++)
+  {
+    JsonVariantConst point = points[i];
+    if (!point["angle"].is<float>() || !point["density"].is<float>())
+    {
+      return false;
+    }
+    float angle = point["angle"];
+    float density = point["density"];
+    if (angle < -90 || angle > 90 || density < DENSITY_MIN || density > DENSITY_MAX)
+    {
+      return false;
+    }
 
-  // Example conversion formula - customize based on your probe design
-  // This assumes a linear relationship, but you might need a more complex formula
-  float density = 1.000 + (calibratedAngle / 45.0) * 0.050; // 45° = 0.05 density units
+    // Insertion sort by angle
+    int j = i;
+    while (j > 0 && angles[j - 1] > angle)
+    {
+      angles[j] = angles[j - 1];
+      densities[j] = densities[j - 1];
+      j--;
+    }
+    angles[j] = angle;
+    densities[j] = density;
+  }
 
-  // Ensure reasonable bounds
-  if (density < 0.900)
-    density = 0.900;
-  if (density > 1.200)
-    density = 1.200;
+  for (int i = 1; i < count; i++)
+  {
+    if (angles[i] - angles[i - 1] < 0.1f)
+    {
+      return false; // Duplicate angles make the curve undefined
+    }
+  }
 
-  return density;
+  settings.calibrationPointCount = count;
+  memcpy(settings.calibrationAngles, angles, sizeof(float) * count);
+  memcpy(settings.calibrationDensities, densities, sizeof(float) * count);
+  return true;
 }
 
 void scanI2CDevices()
@@ -1333,26 +6282,21 @@ void scanI2CDevices()
 
   for (byte address = 1; address < 127; address++)
   {
+    // Sensor task is running: one probe per lock, NACKs are expected here
+    i2c1Lock();
     I2C_1.beginTransmission(address);
     byte error = I2C_1.endTransmission();
+    i2c1Unlock();
 
     if (error == 0)
     {
-      String deviceInfo = "I2C device found on Bus 1 at address 0x";
-      if (address < 16)
-        deviceInfo += "0";
-      deviceInfo += String(address, HEX);
-
       // Identify known devices
+      const char *name = "";
       if (address == 0x68)
-      {
-        deviceInfo += " (MPU6050)";
-      }
+        name = " (MPU6050)";
       else if (address == 0x3C)
-      {
-        deviceInfo += " (OLED Display 1)";
-      }
-      logSerial(deviceInfo);
+        name = " (OLED Display 1)";
+      logSerial("I2C device found on Bus 1 at address 0x%02X%s", address, name);
       deviceCount1++;
     }
   }
@@ -1362,50 +6306,49 @@ void scanI2CDevices()
 
   for (byte address = 1; address < 127; address++)
   {
+    i2c2Lock();
     I2C_2.beginTransmission(address);
     byte error = I2C_2.endTransmission();
+    i2c2Unlock();
 
     if (error == 0)
     {
-      String deviceInfo = "I2C device found on Bus 2 at address 0x";
-      if (address < 16)
-        deviceInfo += "0";
-      deviceInfo += String(address, HEX);
-
       // Identify known devices
+      const char *name = "";
       if (address == 0x68)
-      {
-        deviceInfo += " (DS3231)";
-      }
+        name = " (DS3231)";
       else if (address == 0x3C)
-      {
-        deviceInfo += " (OLED Display 2)";
-      }
-      logSerial(deviceInfo);
+        name = " (OLED Display 2)";
+      logSerial("I2C device found on Bus 2 at address 0x%02X%s", address, name);
       deviceCount2++;
     }
   }
 
-  logSerial("Total devices found: Bus 1: " + String(deviceCount1) +
-            ", Bus 2: " + String(deviceCount2));
+  logSerial("Total devices found: Bus 1: %d, Bus 2: %d", deviceCount1, deviceCount2);
 }
 
 bool checkRTCConnection()
 {
+  i2c2Lock();
   I2C_2.beginTransmission(DS3231_ADDRESS);
   byte error = I2C_2.endTransmission();
+  recordI2cResult(I2C_2, error);
+  i2c2Unlock();
   return (error == 0);
 }
 
 bool checkMPUConnection()
 {
+  i2c1Lock();
   I2C_1.beginTransmission(MPU6050_ADDRESS);
   byte error = I2C_1.endTransmission();
+  recordI2cResult(I2C_1, error);
+  i2c1Unlock();
   return (error == 0);
 }
 
 void setDateTime(int year, int month, int day, int hour, int minute, int second)
 {
-  rtc.adjust(DateTime(year, month, day, hour, minute, second));
+  setClock(DateTime(year, month, day, hour, minute, second).unixtime());
   logSerial("RTC date/time manually set");
 }
\ No newline at end of file